@@ -1,63 +1,555 @@
 #ifndef CB_HPP
 #define CB_HPP
 
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
 // single writer and single reader
-template <typename T>
+//
+// The writer owns m_tail and the reader owns m_head. I is the index policy
+// mapping the positions to slots, cb_index_exact keeps the capacity as
+// requested and cb_index_pow2 rounds it up to a power of two for branchless
+// wrap-around, see cb_common.hpp. W is the wait strategy used while the
+// buffer is empty or full, see cb_wait.hpp. try_push() and try_pop()
+// return false instead of waiting. alloc selects huge pages, NUMA binding
+// and prefaulting for the buffer, see cb_alloc.hpp.
+template <typename T, typename W = cb_wait_busy, typename I = cb_index_exact>
 class cb {
 public:
-    cb(int len) : m_max_len(len),
-                  m_len(0),
-                  m_buf(new T[len]),
-                  m_buf_end(m_buf + len),
-                  m_head(m_buf),
-                  m_tail(m_buf) { }
-    virtual ~cb() { }
-
-    T    pop();
-    void push(const T &val);
-    int  get_len() { return m_len; }
+    cb(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_index(len),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<T>(m_index.size(), m_alloc)),
+          m_head(0),
+          m_tail(0) { }
+    virtual ~cb() { cb_free_buf(m_buf, m_index.size(), m_alloc); }
+
+    T      pop();
+    void   push(const T &val) { push_val(val); }
+    void   push(T &&val) { push_val(std::move(val)); }
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+    // bulk operations publish a whole batch with one index update.
+    // push_n() blocks until all n values are pushed. pop_n() blocks until
+    // at least one value is available and returns the number popped.
+    void   push_n(const T *vals, size_t n);
+    size_t pop_n(T *vals, size_t n);
+
+    // in-place access without blocking. reserve() returns up to n
+    // contiguous free slots, peek() up to n contiguous filled slots.
+    cb_span<T>       reserve(size_t n);
+    void             commit(size_t n);
+    cb_span<const T> peek(size_t n);
+    void             consume(size_t n);
+
+    // zero-copy access to single slots. claim() waits for a free slot
+    // which the writer fills in place, publish() hands it to the reader.
+    // front() waits for a value which the reader uses in place, release()
+    // frees its slot.
+    T   &claim();
+    void publish() { commit(1); }
+    T   &front();
+    void release() { consume(1); }
+
+private:
+    I        m_index;
+    cb_alloc m_alloc;
+    T       *m_buf;
+
+    uint64_t m_head;
+    uint64_t m_tail;
+
+    W m_wait_empty; // reader waits for values
+    W m_wait_full;  // writer waits for free slots
+
+    size_t used_len();
+    size_t free_len();
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
+};
+
+// number of values seen by the reader
+template <typename T, typename W, typename I>
+inline size_t cb<T, W, I>::used_len()
+{
+    return m_index.distance(m_head,
+                            __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE));
+}
+
+// number of free slots seen by the writer
+template <typename T, typename W, typename I>
+inline size_t cb<T, W, I>::free_len()
+{
+    return m_index.size() -
+           m_index.distance(__atomic_load_n(&m_head, __ATOMIC_ACQUIRE),
+                            m_tail);
+}
+
+template <typename T, typename W, typename I>
+inline size_t cb<T, W, I>::get_len()
+{
+    return m_index.distance(__atomic_load_n(&m_head, __ATOMIC_RELAXED),
+                            __atomic_load_n(&m_tail, __ATOMIC_RELAXED));
+}
+
+template <typename T, typename W, typename I>
+inline T cb<T, W, I>::pop()
+{
+    m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
+
+    T retval = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return retval;
+}
+
+template <typename T, typename W, typename I>
+template <typename U>
+inline void cb<T, W, I>::push_val(U &&val)
+{
+    m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+
+    m_buf[m_index.slot(m_tail)] = std::forward<U>(val);
+
+    __atomic_store_n(&m_tail, m_index.next(m_tail, 1), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W, typename I>
+inline bool cb<T, W, I>::try_pop(T &val)
+{
+    if (used_len() == 0) {
+        return false;
+    }
+
+    val = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W, typename I>
+template <typename U>
+inline bool cb<T, W, I>::try_push_val(U &&val)
+{
+    if (free_len() == 0) {
+        return false;
+    }
+
+    m_buf[m_index.slot(m_tail)] = std::forward<U>(val);
+
+    __atomic_store_n(&m_tail, m_index.next(m_tail, 1), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+
+    return true;
+}
+
+template <typename T, typename W, typename I>
+inline void cb<T, W, I>::push_n(const T *vals, size_t n)
+{
+    while (n > 0) {
+        size_t len;
+
+        m_wait_full.wait([&] { return (len = free_len()) != 0; }, &m_head);
+
+        if (len > n) {
+            len = n;
+        }
+
+        cb_copy_in(m_buf, m_index.size(), m_index.slot(m_tail), vals, len);
+
+        __atomic_store_n(&m_tail, m_index.next(m_tail, len), __ATOMIC_RELEASE);
+
+        m_wait_empty.notify();
+
+        vals += len;
+        n    -= len;
+    }
+}
+
+template <typename T, typename W, typename I>
+inline size_t cb<T, W, I>::pop_n(T *vals, size_t n)
+{
+    size_t len;
+
+    m_wait_empty.wait([&] { return (len = used_len()) != 0; }, &m_tail);
+
+    if (len > n) {
+        len = n;
+    }
+
+    cb_copy_out(m_buf, m_index.size(), m_index.slot(m_head), vals, len);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, len), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return len;
+}
+
+template <typename T, typename W, typename I>
+inline cb_span<T> cb<T, W, I>::reserve(size_t n)
+{
+    size_t len = free_len();
+    size_t slot = m_index.slot(m_tail);
+    size_t contig = m_index.size() - slot;
+
+    if (len > contig) {
+        len = contig;
+    }
+
+    if (len > n) {
+        len = n;
+    }
+
+    return cb_span<T>{m_buf + slot, len};
+}
+
+template <typename T, typename W, typename I>
+inline void cb<T, W, I>::commit(size_t n)
+{
+    __atomic_store_n(&m_tail, m_index.next(m_tail, n), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W, typename I>
+inline cb_span<const T> cb<T, W, I>::peek(size_t n)
+{
+    size_t len = used_len();
+    size_t slot = m_index.slot(m_head);
+    size_t contig = m_index.size() - slot;
+
+    if (len > contig) {
+        len = contig;
+    }
+
+    if (len > n) {
+        len = n;
+    }
+
+    return cb_span<const T>{m_buf + slot, len};
+}
+
+template <typename T, typename W, typename I>
+inline void cb<T, W, I>::consume(size_t n)
+{
+    __atomic_store_n(&m_head, m_index.next(m_head, n), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+}
+
+template <typename T, typename W, typename I>
+inline T &cb<T, W, I>::claim()
+{
+    m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+
+    return m_buf[m_index.slot(m_tail)];
+}
+
+template <typename T, typename W, typename I>
+inline T &cb<T, W, I>::front()
+{
+    m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
+
+    return m_buf[m_index.slot(m_head)];
+}
+
+// single writer and single reader without locked instructions
+//
+// The writer owns m_tail and the reader owns m_head, each on its own
+// cache line. Each side keeps a cached copy of the other side's index and
+// re-reads the shared one only when the cached copy says full or empty.
+// W and I are the same as for cb.
+template <typename T, typename W = cb_wait_busy, typename I = cb_index_exact>
+class cb_spsc {
+public:
+    cb_spsc(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_index(len),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<T>(m_index.size(), m_alloc)),
+          m_head(0),
+          m_tail_cache(0),
+          m_tail(0),
+          m_head_cache(0) { }
+    virtual ~cb_spsc() { cb_free_buf(m_buf, m_index.size(), m_alloc); }
+
+    T      pop();
+    void   push(const T &val) { push_val(val); }
+    void   push(T &&val) { push_val(std::move(val)); }
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+    // see cb
+    void   push_n(const T *vals, size_t n);
+    size_t pop_n(T *vals, size_t n);
+
+    cb_span<T>       reserve(size_t n);
+    void             commit(size_t n);
+    cb_span<const T> peek(size_t n);
+    void             consume(size_t n);
+
+    T   &claim();
+    void publish() { commit(1); }
+    T   &front();
+    void release() { consume(1); }
 
 private:
-    int m_max_len;
-    volatile int m_len;
-    T *m_buf;
-    T *m_buf_end;
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) I m_index;
+    cb_alloc m_alloc;
+    T       *m_buf;
 
-    T *m_head;
-    T *m_tail;
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head;
+    uint64_t m_tail_cache;
 
+    // writer
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+    uint64_t m_head_cache;
+
+    // apart, a futex waiter and its notifier write each of them
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_full;
+
+    size_t used_len();
+    size_t free_len();
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
+    bool   is_full_cached();
 };
 
-template <typename T>
-inline T cb<T>::pop()
+// number of values seen by the reader, refreshing m_tail_cache
+template <typename T, typename W, typename I>
+inline size_t cb_spsc<T, W, I>::used_len()
+{
+    m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+
+    return m_index.distance(m_head, m_tail_cache);
+}
+
+// number of free slots seen by the writer, refreshing m_head_cache
+template <typename T, typename W, typename I>
+inline size_t cb_spsc<T, W, I>::free_len()
 {
-    while (m_len == 0);
+    m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+
+    return m_index.size() - m_index.distance(m_head_cache, m_tail);
+}
 
-    T retval = *m_head;
-    __sync_fetch_and_sub(&m_len, 1);
+template <typename T, typename W, typename I>
+inline bool cb_spsc<T, W, I>::is_full_cached()
+{
+    return m_index.distance(m_head_cache, m_tail) == m_index.size();
+}
 
-    m_head++;
+template <typename T, typename W, typename I>
+inline size_t cb_spsc<T, W, I>::get_len()
+{
+    return m_index.distance(__atomic_load_n(&m_head, __ATOMIC_RELAXED),
+                            __atomic_load_n(&m_tail, __ATOMIC_RELAXED));
+}
 
-    if (m_head == m_buf_end) {
-        m_head = m_buf;
+template <typename T, typename W, typename I>
+inline T cb_spsc<T, W, I>::pop()
+{
+    if (m_head == m_tail_cache) {
+        m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
     }
 
+    T retval = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
     return retval;
 }
 
-template <typename T>
-inline void cb<T>::push(const T &val)
+template <typename T, typename W, typename I>
+template <typename U>
+inline void cb_spsc<T, W, I>::push_val(U &&val)
+{
+    if (is_full_cached()) {
+        m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+    }
+
+    m_buf[m_index.slot(m_tail)] = std::forward<U>(val);
+
+    __atomic_store_n(&m_tail, m_index.next(m_tail, 1), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W, typename I>
+inline bool cb_spsc<T, W, I>::try_pop(T &val)
+{
+    if (m_head == m_tail_cache && used_len() == 0) {
+        return false;
+    }
+
+    val = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W, typename I>
+template <typename U>
+inline bool cb_spsc<T, W, I>::try_push_val(U &&val)
+{
+    if (is_full_cached() && free_len() == 0) {
+        return false;
+    }
+
+    m_buf[m_index.slot(m_tail)] = std::forward<U>(val);
+
+    __atomic_store_n(&m_tail, m_index.next(m_tail, 1), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+
+    return true;
+}
+
+template <typename T, typename W, typename I>
+inline void cb_spsc<T, W, I>::push_n(const T *vals, size_t n)
+{
+    while (n > 0) {
+        size_t len;
+
+        m_wait_full.wait([&] { return (len = free_len()) != 0; }, &m_head);
+
+        if (len > n) {
+            len = n;
+        }
+
+        cb_copy_in(m_buf, m_index.size(), m_index.slot(m_tail), vals, len);
+
+        __atomic_store_n(&m_tail, m_index.next(m_tail, len), __ATOMIC_RELEASE);
+
+        m_wait_empty.notify();
+
+        vals += len;
+        n    -= len;
+    }
+}
+
+template <typename T, typename W, typename I>
+inline size_t cb_spsc<T, W, I>::pop_n(T *vals, size_t n)
+{
+    size_t len;
+
+    m_wait_empty.wait([&] { return (len = used_len()) != 0; }, &m_tail);
+
+    if (len > n) {
+        len = n;
+    }
+
+    cb_copy_out(m_buf, m_index.size(), m_index.slot(m_head), vals, len);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, len), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return len;
+}
+
+template <typename T, typename W, typename I>
+inline cb_span<T> cb_spsc<T, W, I>::reserve(size_t n)
+{
+    size_t len = free_len();
+    size_t slot = m_index.slot(m_tail);
+    size_t contig = m_index.size() - slot;
+
+    if (len > contig) {
+        len = contig;
+    }
+
+    if (len > n) {
+        len = n;
+    }
+
+    return cb_span<T>{m_buf + slot, len};
+}
+
+template <typename T, typename W, typename I>
+inline void cb_spsc<T, W, I>::commit(size_t n)
 {
-    while (m_len == m_max_len);
+    __atomic_store_n(&m_tail, m_index.next(m_tail, n), __ATOMIC_RELEASE);
 
-    *m_tail = val;
-    __sync_fetch_and_add(&m_len, 1);
+    m_wait_empty.notify();
+}
 
-    m_tail++;
+template <typename T, typename W, typename I>
+inline cb_span<const T> cb_spsc<T, W, I>::peek(size_t n)
+{
+    size_t len = used_len();
+    size_t slot = m_index.slot(m_head);
+    size_t contig = m_index.size() - slot;
+
+    if (len > contig) {
+        len = contig;
+    }
 
-    if (m_tail == m_buf_end) {
-        m_tail = m_buf;
+    if (len > n) {
+        len = n;
     }
+
+    return cb_span<const T>{m_buf + slot, len};
+}
+
+template <typename T, typename W, typename I>
+inline void cb_spsc<T, W, I>::consume(size_t n)
+{
+    __atomic_store_n(&m_head, m_index.next(m_head, n), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+}
+
+template <typename T, typename W, typename I>
+inline T &cb_spsc<T, W, I>::claim()
+{
+    if (is_full_cached()) {
+        m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+    }
+
+    return m_buf[m_index.slot(m_tail)];
+}
+
+template <typename T, typename W, typename I>
+inline T &cb_spsc<T, W, I>::front()
+{
+    if (m_head == m_tail_cache) {
+        m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
+    }
+
+    return m_buf[m_index.slot(m_head)];
 }
 
 #endif // CB_HPP
@@ -0,0 +1,165 @@
+#ifndef CB_ALLOC_HPP
+#define CB_ALLOC_HPP
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <new>
+#include <system_error>
+
+// allocation policy for the buffers of the cb queues
+//
+// Without any flag and NUMA node the buffer comes from new[] as before.
+// Otherwise it is mapped with mmap(2) so that it can be backed by huge
+// pages, bound to a NUMA node and faulted in at construction instead of in
+// the hot loop. A NUMA node which cannot be bound to throws
+// std::system_error.
+
+#define CB_ALLOC_HUGE     (1 << 0) // back with 2 MiB pages
+#define CB_ALLOC_PREFAULT (1 << 1) // touch every page at construction
+
+#define CB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct cb_alloc {
+    cb_alloc(int flags = 0, int numa_node = -1) : m_flags(flags),
+                                                  m_numa_node(numa_node) { }
+
+    int m_flags;
+    int m_numa_node; // -1 for the default policy of the process
+};
+
+inline bool
+cb_alloc_is_mmap(const cb_alloc &alloc)
+{
+    return alloc.m_flags != 0 || alloc.m_numa_node >= 0;
+}
+
+inline size_t
+cb_alloc_size(size_t size, const cb_alloc &alloc)
+{
+    size_t align = (alloc.m_flags & CB_ALLOC_HUGE) ? CB_HUGE_PAGE_SIZE
+                                                   : getpagesize();
+
+    return (size + align - 1) / align * align;
+}
+
+// allocate and default-construct n values of T
+template <typename T>
+inline T *
+cb_alloc_buf(size_t n, const cb_alloc &alloc)
+{
+    if (! cb_alloc_is_mmap(alloc)) {
+        return new T[n];
+    }
+
+    size_t size   = cb_alloc_size(n * sizeof(T), alloc);
+    size_t pagesz = getpagesize();
+    void  *addr   = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    // explicit huge pages need a reserved pool, fall back to THP below
+    if (alloc.m_flags & CB_ALLOC_HUGE) {
+        addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (addr != MAP_FAILED) {
+            pagesz = CB_HUGE_PAGE_SIZE;
+        }
+    }
+#endif // MAP_HUGETLB
+
+    if (addr == MAP_FAILED) {
+        // THP only backs 2 MiB aligned ranges, so map a huge page more and
+        // trim the slack on both sides. what is left is size bytes from an
+        // aligned base, which cb_free_buf() unmaps as any other mapping
+        size_t slack = (alloc.m_flags & CB_ALLOC_HUGE) ? CB_HUGE_PAGE_SIZE
+                                                       : 0;
+
+        addr = mmap(nullptr, size + slack, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (addr == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        if (slack != 0) {
+            char *base    = static_cast<char *>(addr);
+            char *aligned = (char *)(((uintptr_t)base + slack - 1) &
+                                     ~(uintptr_t)(slack - 1));
+
+            if (aligned != base) {
+                munmap(base, aligned - base);
+            }
+
+            if (aligned + size != base + size + slack) {
+                munmap(aligned + size, base + slack - aligned);
+            }
+
+            addr = aligned;
+
+            madvise(addr, size, MADV_HUGEPAGE);
+        }
+    }
+
+    // bind before the first touch so that pages are placed on the node
+    if (alloc.m_numa_node >= 0) {
+        unsigned long mask[16] = { 0 };
+        unsigned long bits = sizeof(unsigned long) * 8;
+        int           err  = EINVAL;
+
+        if ((size_t)alloc.m_numa_node < sizeof(mask) * 8) {
+            mask[alloc.m_numa_node / bits] |=
+                1UL << (alloc.m_numa_node % bits);
+
+            if (syscall(SYS_mbind, addr, size, MPOL_BIND, mask,
+                        sizeof(mask) * 8, MPOL_MF_MOVE) == 0) {
+                err = 0;
+            } else {
+                err = errno;
+            }
+        }
+
+        if (err != 0) {
+            munmap(addr, size);
+            throw std::system_error(err, std::generic_category(), "mbind");
+        }
+    }
+
+    if (alloc.m_flags & CB_ALLOC_PREFAULT) {
+        for (size_t i = 0; i < size; i += pagesz) {
+            ((volatile char*)addr)[i] = 0;
+        }
+    }
+
+    T *buf = (T*)addr;
+
+    for (size_t i = 0; i < n; i++) {
+        new (buf + i) T;
+    }
+
+    return buf;
+}
+
+// destroy and release a buffer from cb_alloc_buf() with the same policy
+template <typename T>
+inline void
+cb_free_buf(T *buf, size_t n, const cb_alloc &alloc)
+{
+    if (! cb_alloc_is_mmap(alloc)) {
+        delete[] buf;
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        buf[i].~T();
+    }
+
+    munmap(buf, cb_alloc_size(n * sizeof(T), alloc));
+}
+
+#endif // CB_ALLOC_HPP
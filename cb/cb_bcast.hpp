@@ -0,0 +1,303 @@
+#ifndef CB_BCAST_HPP
+#define CB_BCAST_HPP
+
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// single writer broadcasting to a fixed set of readers
+//
+// Disruptor-style ring in which every reader sees every value. Reader i
+// owns a cursor on its own cache line and calls pop(i). The slot at
+// position pos holds a value when its sequence is 2 * pos + 2, so readers
+// wait on the slot and never on each other. The capacity is rounded up to a
+// power of two. W is the wait strategy used while the ring is empty or
+// full.
+//
+// By default the writer gates on the slowest reader. It keeps the position
+// of that reader cached and only rescans the cursors once the cache says
+// the ring is full, so a push costs the same for any number of readers.
+//
+// With LAP the writer never waits and slow readers get lapped instead.
+// Slots are then written like a seqlock: the sequence is 2 * pos + 1 while
+// the value is written. A reader which finds a later sequence, before or
+// after copying the value, has been overrun. It skips ahead to the
+// newer half of the ring and counts the values it lost, see get_overrun().
+// T must be trivially copyable in this mode.
+template <typename T, typename W = cb_wait_busy, bool LAP = false>
+class cb_bcast {
+public:
+    cb_bcast(size_t len, size_t readers, const cb_alloc &alloc = cb_alloc());
+    virtual ~cb_bcast();
+
+    T    pop(size_t reader);
+    void push(const T &val) { push_val(val); }
+    void push(T &&val) { push_val(std::move(val)); }
+
+    bool try_pop(size_t reader, T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+    // values the reader has not seen yet, at most the capacity
+    size_t   get_len(size_t reader);
+    // values the reader lost by being lapped, always 0 without LAP
+    uint64_t get_overrun(size_t reader);
+
+private:
+    struct slot {
+        uint64_t m_seq;
+        T        m_val;
+    };
+
+    struct alignas(CB_CACHE_LINE_SIZE) cursor {
+        cursor() : m_pos(0), m_overrun(0) { }
+
+        uint64_t m_pos;
+        uint64_t m_overrun;
+    };
+
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_mask;
+    cb_alloc m_alloc;
+    slot    *m_buf;
+    cursor  *m_cursor;
+    size_t   m_readers;
+
+    // writer
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+    uint64_t m_gate; // cached position of the slowest reader
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    W m_wait_full;
+
+    uint64_t min_cursor();
+    bool     read(size_t reader, T &val);
+    void     skip(cursor *c);
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
+
+#if __GNUC__ >= 5
+    static_assert(! LAP || std::is_trivially_copyable<T>::value,
+                  "lapping readers need a trivially copyable T");
+#endif // __GNUC__ >= 5
+};
+
+template <typename T, typename W, bool LAP>
+inline cb_bcast<T, W, LAP>::cb_bcast(size_t len, size_t readers,
+                                     const cb_alloc &alloc)
+    : m_mask(cb_round_pow2(len) - 1),
+      m_alloc(alloc),
+      m_buf(cb_alloc_buf<slot>(m_mask + 1, m_alloc)),
+      m_cursor(nullptr),
+      m_readers(readers),
+      m_tail(0),
+      m_gate(0)
+{
+    void *p;
+
+    // plain new does not honour the alignment of cursor before C++17
+    if (posix_memalign(&p, CB_CACHE_LINE_SIZE, sizeof(cursor) * readers)) {
+        cb_free_buf(m_buf, m_mask + 1, m_alloc);
+        throw std::bad_alloc();
+    }
+
+    m_cursor = static_cast<cursor *>(p);
+
+    for (size_t i = 0; i < readers; i++) {
+        new (&m_cursor[i]) cursor;
+    }
+
+    for (uint64_t i = 0; i <= m_mask; i++) {
+        m_buf[i].m_seq = 0;
+    }
+}
+
+template <typename T, typename W, bool LAP>
+inline cb_bcast<T, W, LAP>::~cb_bcast()
+{
+    free(m_cursor);
+    cb_free_buf(m_buf, m_mask + 1, m_alloc);
+}
+
+template <typename T, typename W, bool LAP>
+inline uint64_t cb_bcast<T, W, LAP>::min_cursor()
+{
+    uint64_t min = m_tail;
+
+    for (size_t i = 0; i < m_readers; i++) {
+        uint64_t pos = __atomic_load_n(&m_cursor[i].m_pos, __ATOMIC_ACQUIRE);
+
+        if (pos < min) {
+            min = pos;
+        }
+    }
+
+    return min;
+}
+
+// copy the value at the reader's cursor if there is one. a lapped reader
+// is moved ahead and tries again.
+template <typename T, typename W, bool LAP>
+inline bool cb_bcast<T, W, LAP>::read(size_t reader, T &val)
+{
+    cursor *c = &m_cursor[reader];
+
+    for (;;) {
+        uint64_t pos = c->m_pos;
+        slot    *s   = &m_buf[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE);
+
+        if (! LAP) {
+            if (seq != 2 * pos + 2) {
+                return false;
+            }
+
+            val = s->m_val;
+
+            // the writer may reuse the slot once every cursor is past it
+            __atomic_store_n(&c->m_pos, pos + 1, __ATOMIC_RELEASE);
+
+            return true;
+        }
+
+        if (seq <= 2 * pos + 1) {
+            return false; // not written yet
+        }
+
+        if (seq == 2 * pos + 2) {
+            val = s->m_val;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&s->m_seq, __ATOMIC_RELAXED) == seq) {
+                __atomic_store_n(&c->m_pos, pos + 1, __ATOMIC_RELAXED);
+                return true;
+            }
+        }
+
+        // the slot is being or has been rewritten by a later lap
+        skip(c);
+    }
+}
+
+template <typename T, typename W, bool LAP>
+inline void cb_bcast<T, W, LAP>::skip(cursor *c)
+{
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+    uint64_t pos  = tail - ((m_mask + 1) >> 1);
+
+    // jump to the newer half so the next read is not overrun again at once
+    if (tail < ((m_mask + 1) >> 1) || pos <= c->m_pos) {
+        pos = c->m_pos + 1;
+    }
+
+    __atomic_store_n(&c->m_overrun, c->m_overrun + (pos - c->m_pos),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&c->m_pos, pos, __ATOMIC_RELAXED);
+}
+
+template <typename T, typename W, bool LAP>
+inline T cb_bcast<T, W, LAP>::pop(size_t reader)
+{
+    T retval;
+
+    while (! read(reader, retval)) {
+        uint64_t pos = m_cursor[reader].m_pos;
+        slot    *s   = &m_buf[pos & m_mask];
+
+        // wait until anything is written to the slot; read() tells apart
+        // the value we want from one of a later lap
+        m_wait_empty.wait([&] {
+            return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) > 2 * pos + 1;
+        }, &s->m_seq);
+    }
+
+    if (! LAP) {
+        m_wait_full.notify();
+    }
+
+    return retval;
+}
+
+template <typename T, typename W, bool LAP>
+inline bool cb_bcast<T, W, LAP>::try_pop(size_t reader, T &val)
+{
+    if (! read(reader, val)) {
+        return false;
+    }
+
+    if (! LAP) {
+        m_wait_full.notify();
+    }
+
+    return true;
+}
+
+template <typename T, typename W, bool LAP>
+template <typename U>
+inline void cb_bcast<T, W, LAP>::push_val(U &&val)
+{
+    if (! LAP && m_tail - m_gate > m_mask) {
+        m_wait_full.wait([&] {
+            return m_tail - (m_gate = min_cursor()) <= m_mask;
+        });
+    }
+
+    slot *s = &m_buf[m_tail & m_mask];
+
+    if (LAP) {
+        __atomic_store_n(&s->m_seq, 2 * m_tail + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    s->m_val = std::forward<U>(val);
+
+    __atomic_store_n(&s->m_seq, 2 * m_tail + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_tail, m_tail + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W, bool LAP>
+template <typename U>
+inline bool cb_bcast<T, W, LAP>::try_push_val(U &&val)
+{
+    if (! LAP && m_tail - m_gate > m_mask &&
+        m_tail - (m_gate = min_cursor()) > m_mask) {
+        return false;
+    }
+
+    push_val(std::forward<U>(val));
+
+    return true;
+}
+
+template <typename T, typename W, bool LAP>
+inline size_t cb_bcast<T, W, LAP>::get_len(size_t reader)
+{
+    uint64_t head = __atomic_load_n(&m_cursor[reader].m_pos, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    if (tail <= head) {
+        return 0;
+    }
+
+    return tail - head > m_mask + 1 ? m_mask + 1 : tail - head;
+}
+
+template <typename T, typename W, bool LAP>
+inline uint64_t cb_bcast<T, W, LAP>::get_overrun(size_t reader)
+{
+    return __atomic_load_n(&m_cursor[reader].m_overrun, __ATOMIC_RELAXED);
+}
+
+#endif // CB_BCAST_HPP
@@ -0,0 +1,283 @@
+#ifndef CB_BYTES_HPP
+#define CB_BYTES_HPP
+
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#define CB_BYTES_ALIGN 8        // records start on this boundary
+#define CB_BYTES_PAD   (1 << 0) // record flag, filler up to the wrap point
+
+// header in front of every record
+struct cb_bytes_hdr {
+    uint32_t m_len;   // payload bytes, without header and alignment
+    uint32_t m_flags;
+};
+
+// single writer and single reader of variable-length records
+//
+// Records are a cb_bytes_hdr followed by the payload, packed into one byte
+// buffer at CB_BYTES_ALIGN boundaries. A record never straddles the end of
+// the buffer: if it does not fit before the end, the writer publishes a
+// CB_BYTES_PAD record up to the end, which the reader skips. The writer
+// reserve()s room for a payload, writes it in place and commit()s it, the
+// reader peek()s at the next payload and consume()s it, so there is no copy
+// nor allocation per record. The capacity in bytes is rounded up to a power
+// of two and bounds the largest record. It may be 4 GiB at most, as record
+// lengths are 32 bits. W is the wait strategy used while the buffer is
+// empty or full.
+template <typename W = cb_wait_busy>
+class cb_bytes {
+public:
+    cb_bytes(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_mask(cb_round_pow2(check_len(len)) - 1),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<char>(m_mask + 1, m_alloc)),
+          m_head(0),
+          m_tail_cache(0),
+          m_tail(0),
+          m_head_cache(0),
+          m_rec(0),
+          m_rec_len(0) { }
+    virtual ~cb_bytes() { cb_free_buf(m_buf, m_mask + 1, m_alloc); }
+
+    // room for a payload of len bytes. reserve() waits for it, try_reserve()
+    // returns a null span instead. throws std::length_error if the record
+    // can never fit or len does not fit in 32 bits.
+    cb_span<char> reserve(size_t len);
+    cb_span<char> try_reserve(size_t len);
+    // publish the reserved record, with len bytes of it at most
+    void          commit(size_t len);
+
+    // the next payload, a null span if there is none for try_peek()
+    cb_span<const char> peek();
+    cb_span<const char> try_peek();
+    // free the record returned by the last peek
+    void                consume();
+
+    // copying convenience. pop() returns the payload length, which may be
+    // more than len in which case only len bytes are copied
+    void   push(const void *buf, size_t len);
+    size_t pop(void *buf, size_t len);
+
+    // bytes in use, including headers and padding
+    size_t get_len();
+
+private:
+    // capacity before rounding, a pad record must be able to span it all
+    static size_t check_len(size_t len)
+    {
+        if (len > (size_t)UINT32_MAX + 1) {
+            throw std::length_error("cb_bytes: capacity above 4 GiB");
+        }
+
+        return len < CB_BYTES_ALIGN ? CB_BYTES_ALIGN : len;
+    }
+
+    static size_t rec_size(size_t len)
+    {
+        return (sizeof(cb_bytes_hdr) + len + CB_BYTES_ALIGN - 1) &
+               ~(size_t)(CB_BYTES_ALIGN - 1);
+    }
+
+    cb_bytes_hdr *hdr(uint64_t pos)
+    {
+        return reinterpret_cast<cb_bytes_hdr *>(m_buf + (pos & m_mask));
+    }
+
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_mask;
+    cb_alloc m_alloc;
+    char    *m_buf;
+
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head;
+    uint64_t m_tail_cache;
+
+    // writer
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+    uint64_t m_head_cache;
+    uint64_t m_rec;     // position of the reserved record
+    size_t   m_rec_len; // payload bytes reserved
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    W m_wait_full;
+
+    size_t used_len();
+    size_t free_len();
+};
+
+// bytes seen by the reader, refreshes its copy of m_tail
+template <typename W>
+inline size_t cb_bytes<W>::used_len()
+{
+    m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+
+    return m_tail_cache - m_head;
+}
+
+// free bytes seen by the writer, refreshes its copy of m_head
+template <typename W>
+inline size_t cb_bytes<W>::free_len()
+{
+    m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+
+    return m_mask + 1 - (m_tail - m_head_cache);
+}
+
+template <typename W>
+inline size_t cb_bytes<W>::get_len()
+{
+    return __atomic_load_n(&m_tail, __ATOMIC_RELAXED) -
+           __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+}
+
+template <typename W>
+inline cb_span<char> cb_bytes<W>::try_reserve(size_t len)
+{
+    if (len > UINT32_MAX) {
+        throw std::length_error("cb_bytes: record length above 32 bits");
+    }
+
+    size_t rec = rec_size(len);
+
+    if (rec > m_mask + 1) {
+        throw std::length_error("cb_bytes: record larger than the buffer");
+    }
+
+    size_t contig = m_mask + 1 - (m_tail & m_mask);
+
+    if (rec > contig) {
+        if (m_mask + 1 - (m_tail - m_head_cache) < contig &&
+            free_len() < contig) {
+            return cb_span<char>{nullptr, 0};
+        }
+
+        // publish the filler on its own, the record may only fit once the
+        // reader has skipped it
+        cb_bytes_hdr *pad = hdr(m_tail);
+
+        pad->m_len   = contig - sizeof(cb_bytes_hdr);
+        pad->m_flags = CB_BYTES_PAD;
+
+        __atomic_store_n(&m_tail, m_tail + contig, __ATOMIC_RELEASE);
+
+        m_wait_empty.notify();
+    }
+
+    if (m_mask + 1 - (m_tail - m_head_cache) < rec && free_len() < rec) {
+        return cb_span<char>{nullptr, 0};
+    }
+
+    m_rec     = m_tail;
+    m_rec_len = len;
+
+    return cb_span<char>{m_buf + (m_rec & m_mask) + sizeof(cb_bytes_hdr), len};
+}
+
+template <typename W>
+inline cb_span<char> cb_bytes<W>::reserve(size_t len)
+{
+    cb_span<char> span = try_reserve(len);
+
+    if (span.ptr == nullptr) {
+        m_wait_full.wait([&] {
+            return (span = try_reserve(len)).ptr != nullptr;
+        }, &m_head);
+    }
+
+    return span;
+}
+
+template <typename W>
+inline void cb_bytes<W>::commit(size_t len)
+{
+    cb_bytes_hdr *h = hdr(m_rec);
+
+    if (len > m_rec_len) {
+        len = m_rec_len;
+    }
+
+    h->m_len   = len;
+    h->m_flags = 0;
+
+    __atomic_store_n(&m_tail, m_rec + rec_size(len), __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename W>
+inline cb_span<const char> cb_bytes<W>::try_peek()
+{
+    for (;;) {
+        if (m_head == m_tail_cache && used_len() == 0) {
+            return cb_span<const char>{nullptr, 0};
+        }
+
+        cb_bytes_hdr *h = hdr(m_head);
+
+        if (! (h->m_flags & CB_BYTES_PAD)) {
+            return cb_span<const char>{
+                reinterpret_cast<const char *>(h + 1), h->m_len};
+        }
+
+        __atomic_store_n(&m_head, m_head + rec_size(h->m_len),
+                         __ATOMIC_RELEASE);
+
+        m_wait_full.notify();
+    }
+}
+
+template <typename W>
+inline cb_span<const char> cb_bytes<W>::peek()
+{
+    cb_span<const char> span = try_peek();
+
+    if (span.ptr == nullptr) {
+        m_wait_empty.wait([&] {
+            return (span = try_peek()).ptr != nullptr;
+        }, &m_tail);
+    }
+
+    return span;
+}
+
+template <typename W>
+inline void cb_bytes<W>::consume()
+{
+    __atomic_store_n(&m_head, m_head + rec_size(hdr(m_head)->m_len),
+                     __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+}
+
+template <typename W>
+inline void cb_bytes<W>::push(const void *buf, size_t len)
+{
+    cb_span<char> span = reserve(len);
+
+    memcpy(span.ptr, buf, len);
+
+    commit(len);
+}
+
+template <typename W>
+inline size_t cb_bytes<W>::pop(void *buf, size_t len)
+{
+    cb_span<const char> span = peek();
+    size_t              ret  = span.len;
+
+    memcpy(buf, span.ptr, span.len < len ? span.len : len);
+
+    consume();
+
+    return ret;
+}
+
+#endif // CB_BYTES_HPP
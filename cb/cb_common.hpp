@@ -0,0 +1,186 @@
+#ifndef CB_COMMON_HPP
+#define CB_COMMON_HPP
+
+#include "cpu_features.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+// indices owned by different threads are placed on different cache lines
+// to avoid false sharing
+#define CB_CACHE_LINE_SIZE 64
+
+// smallest power of two not less than n, std::length_error if there is
+// none in a size_t
+inline size_t
+cb_round_pow2(size_t n)
+{
+    if (n > ~(SIZE_MAX >> 1)) {
+        throw std::length_error("cb: capacity above 2^63");
+    }
+
+    size_t size = 1;
+
+    while (size < n) {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+// index policies map the positions of the head and the tail to slots.
+// the length is the distance between the two positions, so no counter is
+// shared between the reader and the writers.
+
+// keep the capacity as requested. positions run over [0, 2 * size) to tell
+// full from empty and wrap around with compare-and-reset.
+class cb_index_exact {
+public:
+    cb_index_exact(size_t len) : m_size(len) { }
+
+    size_t size() const { return m_size; }
+
+    size_t slot(uint64_t pos) const
+    {
+        return pos < m_size ? pos : pos - m_size;
+    }
+
+    uint64_t next(uint64_t pos, size_t n) const
+    {
+        pos += n;
+        return pos < 2 * m_size ? pos : pos - 2 * m_size;
+    }
+
+    size_t distance(uint64_t head, uint64_t tail) const
+    {
+        return tail >= head ? tail - head : tail + 2 * m_size - head;
+    }
+
+private:
+    size_t m_size;
+};
+
+// round the capacity up to a power of two. positions are free-running
+// 64-bit counters, so wrap-around is a mask and the length is tail - head.
+class cb_index_pow2 {
+public:
+    cb_index_pow2(size_t len) : m_mask(cb_round_pow2(len) - 1) { }
+
+    size_t   size() const { return m_mask + 1; }
+    size_t   slot(uint64_t pos) const { return pos & m_mask; }
+    uint64_t next(uint64_t pos, size_t n) const { return pos + n; }
+    size_t   distance(uint64_t head, uint64_t tail) const
+    {
+        return tail - head;
+    }
+
+private:
+    size_t m_mask;
+};
+
+// contiguous run of slots handed out by reserve() and peek()
+template <typename T>
+struct cb_span {
+    T     *ptr;
+    size_t len;
+};
+
+inline void
+cb_copy_bytes_portable(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+#ifdef __x86_64__
+// 32 bytes per unaligned load and store. a vector type rather than
+// immintrin.h, whose rtm intrinsics clash with rtm.h
+typedef char cb_bytes32
+    __attribute__((vector_size(32), aligned(1), may_alias));
+
+CPU_TARGET("avx2") inline void
+cb_copy_bytes_avx2(void *dst, const void *src, size_t len)
+{
+    char       *d = static_cast<char *>(dst);
+    const char *s = static_cast<const char *>(src);
+
+    for (; len >= 32; len -= 32, d += 32, s += 32) {
+        *reinterpret_cast<cb_bytes32 *>(d) =
+            *reinterpret_cast<const cb_bytes32 *>(s);
+    }
+
+    memcpy(d, s, len);
+}
+#endif // __x86_64__
+
+// copy len bytes between a ring and a buffer of the caller, which never
+// overlap. the kernel is picked once per process
+inline void
+cb_copy_bytes(void *dst, const void *src, size_t len)
+{
+#ifdef __x86_64__
+    static void (*const copy)(void *, const void *, size_t) =
+        cpu_select(cpu_get_features().m_avx2, cb_copy_bytes_avx2,
+                   cb_copy_bytes_portable);
+
+    copy(dst, src, len);
+#else
+    cb_copy_bytes_portable(dst, src, len);
+#endif // __x86_64__
+}
+
+// values which may be copied as bytes
+#if __GNUC__ >= 5
+template <typename T>
+struct cb_is_bytes : std::is_trivially_copyable<T> { };
+#else
+template <typename T>
+struct cb_is_bytes : std::is_trivial<T> { };
+#endif // __GNUC__ >= 5
+
+template <typename T>
+inline void
+cb_copy_vals(T *dst, const T *src, size_t n, std::true_type)
+{
+    // most copies do not wrap, skip the empty second half
+    if (n != 0) {
+        cb_copy_bytes(dst, src, n * sizeof(T));
+    }
+}
+
+template <typename T>
+inline void
+cb_copy_vals(T *dst, const T *src, size_t n, std::false_type)
+{
+    std::copy(src, src + n, dst);
+}
+
+// copy n values into a ring of size slots starting at slot pos, wrapping
+// around at most once
+template <typename T>
+inline void
+cb_copy_in(T *buf, size_t size, size_t pos, const T *vals, size_t n)
+{
+    size_t n0 = size - pos < n ? size - pos : n;
+
+    cb_copy_vals(buf + pos, vals, n0, cb_is_bytes<T>());
+    cb_copy_vals(buf, vals + n0, n - n0, cb_is_bytes<T>());
+}
+
+// copy n values out of a ring of size slots starting at slot pos, wrapping
+// around at most once
+template <typename T>
+inline void
+cb_copy_out(const T *buf, size_t size, size_t pos, T *vals, size_t n)
+{
+    size_t n0 = size - pos < n ? size - pos : n;
+
+    cb_copy_vals(vals, buf + pos, n0, cb_is_bytes<T>());
+    cb_copy_vals(vals + n0, buf, n - n0, cb_is_bytes<T>());
+}
+
+#endif // CB_COMMON_HPP
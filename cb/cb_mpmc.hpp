@@ -0,0 +1,189 @@
+#ifndef CB_MPMC_HPP
+#define CB_MPMC_HPP
+
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
+// multiple writers and multiple readers without locks
+//
+// Same per-slot sequencing as cb_mpsc, but readers also claim positions on
+// m_head, so they only synchronize through the slots they read. push() and
+// pop() take a ticket with one fetch-and-add and wait on their own slot.
+// try_push() and try_pop() claim a position with CAS only when the slot is
+// ready and return false instead of waiting when the queue is full or
+// empty. The capacity is rounded up to a power of two. W is the wait
+// strategy used by push() and pop().
+template <typename T, typename W = cb_wait_busy>
+class cb_mpmc {
+public:
+    cb_mpmc(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_mask(cb_round_pow2(len) - 1),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<slot>(m_mask + 1, m_alloc)),
+          m_head(0),
+          m_tail(0)
+    {
+        for (uint64_t i = 0; i <= m_mask; i++) {
+            m_buf[i].m_seq = i;
+        }
+    }
+    virtual ~cb_mpmc() { cb_free_buf(m_buf, m_mask + 1, m_alloc); }
+
+    T      pop();
+    void   push(const T &val) { push_val(val); }
+    void   push(T &&val) { push_val(std::move(val)); }
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+private:
+    struct slot {
+        uint64_t m_seq;
+        T        m_val;
+    };
+
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_mask;
+    cb_alloc m_alloc;
+    slot    *m_buf;
+
+    // readers
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head;
+
+    // writers
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    W m_wait_full;
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
+};
+
+template <typename T, typename W>
+inline T cb_mpmc<T, W>::pop()
+{
+    uint64_t pos = __atomic_fetch_add(&m_head, 1, __ATOMIC_RELAXED);
+    slot *s = &m_buf[pos & m_mask];
+
+    m_wait_empty.wait([&] {
+        return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) == pos + 1;
+    }, &s->m_seq);
+
+    T retval = std::move(s->m_val);
+
+    __atomic_store_n(&s->m_seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return retval;
+}
+
+template <typename T, typename W>
+template <typename U>
+inline void cb_mpmc<T, W>::push_val(U &&val)
+{
+    uint64_t pos = __atomic_fetch_add(&m_tail, 1, __ATOMIC_RELAXED);
+    slot *s = &m_buf[pos & m_mask];
+
+    m_wait_full.wait([&] {
+        return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) == pos;
+    }, &s->m_seq);
+
+    s->m_val = std::forward<U>(val);
+
+    __atomic_store_n(&s->m_seq, pos + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W>
+inline bool cb_mpmc<T, W>::try_pop(T &val)
+{
+    uint64_t pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    slot *s;
+
+    for (;;) {
+        s = &m_buf[pos & m_mask];
+
+        int64_t diff = (int64_t)(__atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) -
+                                 (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&m_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // empty
+        } else {
+            pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    val = std::move(s->m_val);
+
+    __atomic_store_n(&s->m_seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W>
+template <typename U>
+inline bool cb_mpmc<T, W>::try_push_val(U &&val)
+{
+    uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+    slot *s;
+
+    for (;;) {
+        s = &m_buf[pos & m_mask];
+
+        int64_t diff = (int64_t)(__atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) -
+                                 pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->m_val = std::forward<U>(val);
+
+    __atomic_store_n(&s->m_seq, pos + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+
+    return true;
+}
+
+template <typename T, typename W>
+inline size_t cb_mpmc<T, W>::get_len()
+{
+    uint64_t head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    // blocked readers and writers hold tickets beyond the stored values
+    if (tail <= head) {
+        return 0;
+    }
+
+    return tail - head > m_mask + 1 ? m_mask + 1 : tail - head;
+}
+
+#endif // CB_MPMC_HPP
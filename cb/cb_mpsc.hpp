@@ -0,0 +1,204 @@
+#ifndef CB_MPSC_HPP
+#define CB_MPSC_HPP
+
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
+// multiple writers and single reader without locks
+//
+// Bounded queue with per-slot sequence numbers in the style of Dmitry
+// Vyukov's MPMC queue. A writer claims a slot with one fetch-and-add on
+// m_tail and then waits only for that slot to be released by the reader,
+// so writers never wait for each other. The slot at position pos is free
+// for the writer when its sequence is pos and holds a value for the reader
+// when its sequence is pos + 1. The capacity is rounded up to a power of
+// two. W is the wait strategy used while the buffer is empty or full.
+template <typename T, typename W = cb_wait_busy>
+class cb_mpsc {
+public:
+    cb_mpsc(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_mask(cb_round_pow2(len) - 1),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<slot>(m_mask + 1, m_alloc)),
+          m_head(0),
+          m_tail(0)
+    {
+        for (uint64_t i = 0; i <= m_mask; i++) {
+            m_buf[i].m_seq = i;
+        }
+    }
+    virtual ~cb_mpsc() { cb_free_buf(m_buf, m_mask + 1, m_alloc); }
+
+    T      pop();
+    void   push(const T &val) { push_val(val); }
+    void   push(T &&val) { push_val(std::move(val)); }
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+    // zero-copy access to the head for the single reader. front() waits
+    // for a value which is used in place, release() frees its slot.
+    T   &front();
+    void release();
+
+private:
+    struct slot {
+        uint64_t m_seq;
+        T        m_val;
+    };
+
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_mask;
+    cb_alloc m_alloc;
+    slot    *m_buf;
+
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head;
+
+    // writers
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    W m_wait_full;
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
+};
+
+template <typename T, typename W>
+inline T cb_mpsc<T, W>::pop()
+{
+    slot *s = &m_buf[m_head & m_mask];
+
+    m_wait_empty.wait([&] {
+        return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) == m_head + 1;
+    }, &s->m_seq);
+
+    T retval = std::move(s->m_val);
+
+    // hand the slot to the writer of the next lap
+    __atomic_store_n(&s->m_seq, m_head + m_mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELAXED);
+
+    m_wait_full.notify();
+
+    return retval;
+}
+
+template <typename T, typename W>
+template <typename U>
+inline void cb_mpsc<T, W>::push_val(U &&val)
+{
+    uint64_t pos = __atomic_fetch_add(&m_tail, 1, __ATOMIC_RELAXED);
+    slot *s = &m_buf[pos & m_mask];
+
+    m_wait_full.wait([&] {
+        return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) == pos;
+    }, &s->m_seq);
+
+    s->m_val = std::forward<U>(val);
+
+    __atomic_store_n(&s->m_seq, pos + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W>
+inline bool cb_mpsc<T, W>::try_pop(T &val)
+{
+    slot *s = &m_buf[m_head & m_mask];
+
+    if (__atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) != m_head + 1) {
+        return false;
+    }
+
+    val = std::move(s->m_val);
+
+    __atomic_store_n(&s->m_seq, m_head + m_mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELAXED);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W>
+template <typename U>
+inline bool cb_mpsc<T, W>::try_push_val(U &&val)
+{
+    uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+    slot *s;
+
+    for (;;) {
+        s = &m_buf[pos & m_mask];
+
+        int64_t diff = (int64_t)(__atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) -
+                                 pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->m_val = std::forward<U>(val);
+
+    __atomic_store_n(&s->m_seq, pos + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+
+    return true;
+}
+
+template <typename T, typename W>
+inline T &cb_mpsc<T, W>::front()
+{
+    slot *s = &m_buf[m_head & m_mask];
+
+    m_wait_empty.wait([&] {
+        return __atomic_load_n(&s->m_seq, __ATOMIC_ACQUIRE) == m_head + 1;
+    }, &s->m_seq);
+
+    return s->m_val;
+}
+
+template <typename T, typename W>
+inline void cb_mpsc<T, W>::release()
+{
+    slot *s = &m_buf[m_head & m_mask];
+
+    __atomic_store_n(&s->m_seq, m_head + m_mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELAXED);
+
+    m_wait_full.notify();
+}
+
+template <typename T, typename W>
+inline size_t cb_mpsc<T, W>::get_len()
+{
+    uint64_t head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+
+    // claimed slots of blocked writers are counted as well
+    if (tail <= head) {
+        return 0;
+    }
+
+    return tail - head > m_mask + 1 ? m_mask + 1 : tail - head;
+}
+
+#endif // CB_MPSC_HPP
@@ -4,71 +4,249 @@
 #include "rtm_lock.hpp"
 #include "tsx-cpuid.h"
 
+#include "cb_alloc.hpp"
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
 #include <iostream>
 
 // multiple writers and single reader
-template <typename T>
+//
+// Writers serialize on the lock and own m_tail, the single reader owns
+// m_head and never takes the lock. W and I are the wait strategy and the
+// index policy, see cb.hpp.
+template <typename T, typename W = cb_wait_busy, typename I = cb_index_exact>
 class cb_ms {
 public:
-    cb_ms(int len) : m_max_len(len),
-                     m_len(0),
-                     m_buf(new T[len]),
-                     m_buf_end(m_buf + len),
-                     m_head(m_buf),
-                     m_tail(m_buf) { }
-    virtual ~cb_ms() { delete[] m_buf; }
-
-    T    pop();
-    void push(const T &val);
-    int  get_len() { return m_len; }
+    cb_ms(size_t len, const cb_alloc &alloc = cb_alloc())
+        : m_index(len),
+          m_alloc(alloc),
+          m_buf(cb_alloc_buf<T>(m_index.size(), m_alloc)),
+          m_head(0),
+          m_tail(0) { }
+    virtual ~cb_ms() { cb_free_buf(m_buf, m_index.size(), m_alloc); }
+
+    T      pop();
+    void   push(const T &val) { push_val(val); }
+    void   push(T &&val) { push_val(std::move(val)); }
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val) { return try_push_val(val); }
+    bool try_push(T &&val) { return try_push_val(std::move(val)); }
+
+    // bulk operations publish a whole batch under one lock acquisition.
+    // push_n() blocks until all n values are pushed. pop_n() blocks until
+    // at least one value is available and returns the number popped.
+    void   push_n(const T *vals, size_t n);
+    size_t pop_n(T *vals, size_t n);
+
+    // in-place access to the head without blocking for the single reader
+    cb_span<const T> peek(size_t n);
+    void             consume(size_t n);
+
+    // zero-copy access to the head for the single reader. front() waits
+    // for a value which is used in place, release() frees its slot.
+    T   &front();
+    void release() { consume(1); }
 
 private:
-    int m_max_len;
-    volatile int m_len;
-    T *m_buf;
-    T *m_buf_end;
+    I        m_index;
+    cb_alloc m_alloc;
+    T       *m_buf;
 
-    T *m_head;
-    T *m_tail;
+    uint64_t m_head;
+    uint64_t m_tail;
 
     rtm_lock m_rtm_lock;
+
+    W m_wait_empty; // reader waits for values
+    W m_wait_full;  // writers wait for free slots
+
+    size_t used_len();
+    size_t free_len();
+
+    template <typename U> void push_val(U &&val);
+    template <typename U> bool try_push_val(U &&val);
 };
 
-template <typename T>
-inline T cb_ms<T>::pop()
+// number of values seen by the reader
+template <typename T, typename W, typename I>
+inline size_t cb_ms<T, W, I>::used_len()
+{
+    return m_index.distance(m_head,
+                            __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE));
+}
+
+// number of free slots seen by the writers
+template <typename T, typename W, typename I>
+inline size_t cb_ms<T, W, I>::free_len()
 {
-    while (m_len == 0);
+    return m_index.size() -
+           m_index.distance(__atomic_load_n(&m_head, __ATOMIC_ACQUIRE),
+                            __atomic_load_n(&m_tail, __ATOMIC_RELAXED));
+}
+
+template <typename T, typename W, typename I>
+inline size_t cb_ms<T, W, I>::get_len()
+{
+    return m_index.distance(__atomic_load_n(&m_head, __ATOMIC_RELAXED),
+                            __atomic_load_n(&m_tail, __ATOMIC_RELAXED));
+}
+
+template <typename T, typename W, typename I>
+inline T cb_ms<T, W, I>::pop()
+{
+    m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
+
+    T retval = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
 
-    T retval = *m_head;
+    return retval;
+}
+
+template <typename T, typename W, typename I>
+template <typename U>
+inline void cb_ms<T, W, I>::push_val(U &&val)
+{
+    while (! try_push_val(std::forward<U>(val))) {
+        m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+    }
+}
+
+template <typename T, typename W, typename I>
+inline bool cb_ms<T, W, I>::try_pop(T &val)
+{
+    if (used_len() == 0) {
+        return false;
+    }
+
+    val = std::move(m_buf[m_index.slot(m_head)]);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, 1), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W, typename I>
+template <typename U>
+inline bool cb_ms<T, W, I>::try_push_val(U &&val)
+{
+    if (free_len() == 0) {
+        return false;
+    }
 
     {
         rtm_transaction transaction(m_rtm_lock);
-        m_len--;
-    }
 
-    m_head++;
+        // other writers may have filled the buffer in the meantime
+        if (free_len() == 0) {
+            return false;
+        }
+
+        m_buf[m_index.slot(m_tail)] = std::forward<U>(val);
 
-    if (m_head == m_buf_end) {
-        m_head = m_buf;
+        __atomic_store_n(&m_tail, m_index.next(m_tail, 1), __ATOMIC_RELEASE);
     }
 
-    return retval;
+    m_wait_empty.notify();
+
+    return true;
 }
 
-template <typename T>
-inline void cb_ms<T>::push(const T &val)
+template <typename T, typename W, typename I>
+inline void cb_ms<T, W, I>::push_n(const T *vals, size_t n)
 {
-    while (m_len == m_max_len);
+    while (n > 0) {
+        size_t len;
+
+        m_wait_full.wait([&] { return free_len() != 0; }, &m_head);
+
+        {
+            rtm_transaction transaction(m_rtm_lock);
+
+            // other writers may have filled the buffer in the meantime
+            len = free_len();
+
+            if (len > n) {
+                len = n;
+            }
+
+            cb_copy_in(m_buf, m_index.size(), m_index.slot(m_tail), vals, len);
 
-    rtm_transaction transaction(m_rtm_lock);
+            __atomic_store_n(&m_tail, m_index.next(m_tail, len),
+                             __ATOMIC_RELEASE);
+        }
 
-    *m_tail = val;
-    m_len++;
-    m_tail++;
+        m_wait_empty.notify();
 
-    if (m_tail == m_buf_end) {
-        m_tail = m_buf;
+        vals += len;
+        n    -= len;
     }
 }
 
+template <typename T, typename W, typename I>
+inline size_t cb_ms<T, W, I>::pop_n(T *vals, size_t n)
+{
+    size_t len;
+
+    m_wait_empty.wait([&] { return (len = used_len()) != 0; }, &m_tail);
+
+    if (len > n) {
+        len = n;
+    }
+
+    cb_copy_out(m_buf, m_index.size(), m_index.slot(m_head), vals, len);
+
+    __atomic_store_n(&m_head, m_index.next(m_head, len), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return len;
+}
+
+template <typename T, typename W, typename I>
+inline cb_span<const T> cb_ms<T, W, I>::peek(size_t n)
+{
+    size_t len = used_len();
+    size_t slot = m_index.slot(m_head);
+    size_t contig = m_index.size() - slot;
+
+    if (len > contig) {
+        len = contig;
+    }
+
+    if (len > n) {
+        len = n;
+    }
+
+    return cb_span<const T>{m_buf + slot, len};
+}
+
+template <typename T, typename W, typename I>
+inline void cb_ms<T, W, I>::consume(size_t n)
+{
+    __atomic_store_n(&m_head, m_index.next(m_head, n), __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+}
+
+template <typename T, typename W, typename I>
+inline T &cb_ms<T, W, I>::front()
+{
+    m_wait_empty.wait([&] { return used_len() != 0; }, &m_tail);
+
+    return m_buf[m_index.slot(m_head)];
+}
+
 #endif // CB_MS_HPP
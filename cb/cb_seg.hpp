@@ -0,0 +1,290 @@
+#ifndef CB_SEG_HPP
+#define CB_SEG_HPP
+
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+#include "reclaim.hpp"
+#include "spin_lock.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// unbounded queue of multiple writers and a single reader
+//
+// A linked list of fixed-size segments. A writer takes an index in the
+// tail segment with one fetch-and-add and fills that slot; when the
+// segment is full it links a fresh one and moves m_tail on. The reader
+// walks the slots of the head segment and then follows m_next. So a push
+// never blocks and costs about what it does in a bounded ring, apart from
+// entering a guard of the reclamation domain R, see reclaim.hpp.
+//
+// Drained segments are retired to R, since writers may still be looking
+// at them, and come back to a pool once R frees them. R frees them in
+// batches, so the pool keeps up to pool_max segments, by default twice
+// R::batch(), and a steady flow does not allocate once it is warm. W is
+// the wait strategy of the reader while the queue is empty.
+template <typename T, typename W = cb_wait_busy, typename R = ebr>
+class cb_seg {
+public:
+    cb_seg(size_t seg_len = 1024, size_t pool_max = 2 * R::batch());
+    virtual ~cb_seg();
+
+    T    pop();
+    void push(const T &val) { push_val(val); }
+    void push(T &&val) { push_val(std::move(val)); }
+
+    bool try_pop(T &val);
+
+private:
+    struct slot {
+        uint32_t m_ready;
+        T        m_val;
+    };
+
+    struct segment {
+        segment(cb_seg *owner, size_t len)
+            : m_enq(0), m_next(nullptr), m_owner(owner),
+              m_slot(new slot[len]) { reset(len); }
+        ~segment() { delete[] m_slot; }
+
+        void reset(size_t len)
+        {
+            m_enq  = 0;
+            m_next = nullptr;
+
+            for (size_t i = 0; i < len; i++) {
+                m_slot[i].m_ready = 0;
+            }
+        }
+
+        // padded rather than aligned, plain new cannot over-align before
+        // C++17
+        uint64_t m_enq; // next index to claim
+        char     m_pad[CB_CACHE_LINE_SIZE - sizeof(uint64_t)];
+        segment *m_next;
+        cb_seg  *m_owner;
+        slot    *m_slot;
+    };
+
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) size_t m_seg_len;
+
+    // free segments, taken by writers about once per m_seg_len pushes
+    struct pool {
+        pool(size_t max) : m_max(max) { m_seg.reserve(max); }
+        ~pool()
+        {
+            for (segment *seg : m_seg) {
+                delete seg;
+            }
+        }
+
+        spin_lock              m_lock;
+        std::vector<segment *> m_seg;
+        size_t                 m_max;
+    };
+
+    pool m_pool;
+
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) segment *m_head;
+    size_t m_deq;
+
+    // writers
+    alignas(CB_CACHE_LINE_SIZE) segment *m_tail;
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+
+    // destroyed before the pool, so it can still recycle into it
+    R m_reclaim;
+
+    segment *get_segment();
+    void     put_segment(segment *seg);
+    bool     next_segment(bool wait);
+
+    static void recycle(void *p);
+
+    template <typename U> void push_val(U &&val);
+};
+
+template <typename T, typename W, typename R>
+inline cb_seg<T, W, R>::cb_seg(size_t seg_len, size_t pool_max)
+    : m_seg_len(seg_len),
+      m_pool(pool_max),
+      m_head(new segment(this, seg_len)),
+      m_deq(0),
+      m_tail(m_head) { }
+
+template <typename T, typename W, typename R>
+inline cb_seg<T, W, R>::~cb_seg()
+{
+    segment *seg = m_head;
+
+    while (seg != nullptr) {
+        segment *next = seg->m_next;
+        delete seg;
+        seg = next;
+    }
+}
+
+template <typename T, typename W, typename R>
+inline typename cb_seg<T, W, R>::segment *cb_seg<T, W, R>::get_segment()
+{
+    {
+        spin_lock_ac lock(m_pool.m_lock);
+
+        if (! m_pool.m_seg.empty()) {
+            segment *seg = m_pool.m_seg.back();
+
+            m_pool.m_seg.pop_back();
+
+            return seg;
+        }
+    }
+
+    return new segment(this, m_seg_len);
+}
+
+template <typename T, typename W, typename R>
+inline void cb_seg<T, W, R>::put_segment(segment *seg)
+{
+    seg->reset(m_seg_len);
+
+    {
+        spin_lock_ac lock(m_pool.m_lock);
+
+        if (m_pool.m_seg.size() < m_pool.m_max) {
+            m_pool.m_seg.push_back(seg);
+            return;
+        }
+    }
+
+    delete seg;
+}
+
+// deleter for R, which frees a segment once no writer can reach it
+template <typename T, typename W, typename R>
+inline void cb_seg<T, W, R>::recycle(void *p)
+{
+    segment *seg = static_cast<segment *>(p);
+
+    seg->m_owner->put_segment(seg);
+}
+
+template <typename T, typename W, typename R>
+template <typename U>
+inline void cb_seg<T, W, R>::push_val(U &&val)
+{
+    typename R::guard guard(m_reclaim);
+
+    for (;;) {
+        segment *seg = guard.protect(0, &m_tail);
+        uint64_t idx = __atomic_fetch_add(&seg->m_enq, 1, __ATOMIC_RELAXED);
+
+        if (idx < m_seg_len) {
+            slot *s = &seg->m_slot[idx];
+
+            s->m_val = std::forward<U>(val);
+
+            __atomic_store_n(&s->m_ready, 1, __ATOMIC_RELEASE);
+
+            m_wait_empty.notify();
+
+            return;
+        }
+
+        // full, link a fresh segment unless somebody else did
+        segment *next = __atomic_load_n(&seg->m_next, __ATOMIC_ACQUIRE);
+
+        if (next == nullptr) {
+            segment *fresh = get_segment();
+
+            if (__atomic_compare_exchange_n(&seg->m_next, &next, fresh,
+                                            false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                next = fresh;
+            } else {
+                put_segment(fresh);
+            }
+        }
+
+        __atomic_compare_exchange_n(&m_tail, &seg, next, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+// move the reader on once the head segment is drained. false if the next
+// segment is not linked yet and wait is false
+template <typename T, typename W, typename R>
+inline bool cb_seg<T, W, R>::next_segment(bool wait)
+{
+    segment *seg  = m_head;
+    segment *next = __atomic_load_n(&seg->m_next, __ATOMIC_ACQUIRE);
+
+    if (next == nullptr) {
+        if (! wait) {
+            return false;
+        }
+
+        m_wait_empty.wait([&] {
+            return (next = __atomic_load_n(&seg->m_next,
+                                           __ATOMIC_ACQUIRE)) != nullptr;
+        }, &seg->m_next);
+    }
+
+    // writers must not find the segment through m_tail any more
+    segment *expected = seg;
+
+    __atomic_compare_exchange_n(&m_tail, &expected, next, false,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+    m_head = next;
+    m_deq  = 0;
+
+    m_reclaim.retire(seg, recycle);
+
+    return true;
+}
+
+template <typename T, typename W, typename R>
+inline T cb_seg<T, W, R>::pop()
+{
+    if (m_deq == m_seg_len) {
+        next_segment(true);
+    }
+
+    slot *s = &m_head->m_slot[m_deq];
+
+    m_wait_empty.wait([&] {
+        return __atomic_load_n(&s->m_ready, __ATOMIC_ACQUIRE) != 0;
+    }, &s->m_ready);
+
+    m_deq++;
+
+    return std::move(s->m_val);
+}
+
+template <typename T, typename W, typename R>
+inline bool cb_seg<T, W, R>::try_pop(T &val)
+{
+    if (m_deq == m_seg_len && ! next_segment(false)) {
+        return false;
+    }
+
+    slot *s = &m_head->m_slot[m_deq];
+
+    if (! __atomic_load_n(&s->m_ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    m_deq++;
+
+    val = std::move(s->m_val);
+
+    return true;
+}
+
+#endif // CB_SEG_HPP
@@ -0,0 +1,364 @@
+#ifndef CB_SHM_HPP
+#define CB_SHM_HPP
+
+#include "cb_common.hpp"
+#include "cb_wait.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#define CB_SHM_MAGIC   0x676e697268736263ULL // "cbshring"
+#define CB_SHM_VERSION 1
+
+// layout at the start of the shared region. the slots follow at m_buf_off,
+// an offset rather than a pointer since every process maps the region at
+// another address.
+struct cb_shm_header {
+    // set once by the creator, m_magic last
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_magic;
+    uint32_t m_version;
+    uint32_t m_elem_size;
+    uint64_t m_mask;
+    uint64_t m_buf_off;
+
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head;
+
+    // writer
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail;
+};
+
+// single writer and single reader in different processes
+//
+// cb_spsc laid out in a shared memory region, either a POSIX shared memory
+// object found by name or a memfd passed to the other process by fork() or
+// over a unix socket. One process creates the ring, the other attaches to
+// it and checks the magic, version and element size in the header. T must
+// be trivially copyable since it is copied between address spaces as is.
+// The capacity is rounded up to a power of two.
+//
+// W is kept in each process and cannot wake the other one, so only the
+// spinning strategies (busy, pause, backoff, umwait) may be used.
+template <typename T, typename W = cb_wait_busy>
+class cb_shm {
+public:
+    // create a ring of len values. name is a shm_open() name such as
+    // "/feed", or nullptr for an anonymous memfd, see get_fd()
+    cb_shm(const char *name, size_t len);
+    // attach to the ring created under name
+    explicit cb_shm(const char *name);
+    // attach to the ring in fd, which is duplicated
+    explicit cb_shm(int fd);
+    virtual ~cb_shm();
+
+    T      pop();
+    void   push(const T &val);
+    size_t get_len();
+
+    bool try_pop(T &val);
+    bool try_push(const T &val);
+
+    // descriptor of the region, e.g. to send a memfd to another process
+    int get_fd() const { return m_fd; }
+
+private:
+    // read only after construction
+    alignas(CB_CACHE_LINE_SIZE) cb_shm_header *m_hdr;
+    T          *m_buf;
+    uint64_t    m_mask;
+    size_t      m_map_len;
+    int         m_fd;
+    std::string m_name; // unlinked on destruction by the creator
+
+    // reader
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_tail_cache;
+
+    // writer
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_head_cache;
+
+    alignas(CB_CACHE_LINE_SIZE) W m_wait_empty;
+    W m_wait_full;
+
+    void   map(size_t len);
+    void   attach();
+    void   fail(const char *what);
+    size_t used_len();
+    size_t free_len();
+
+#if __GNUC__ >= 5
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "values in shared memory must be trivially copyable");
+#endif // __GNUC__ >= 5
+    static_assert(! std::is_same<W, cb_wait_futex>::value,
+                  "cb_wait_futex cannot wake another process");
+};
+
+template <typename T, typename W>
+inline cb_shm<T, W>::cb_shm(const char *name, size_t len)
+    : m_hdr(nullptr), m_buf(nullptr), m_mask(cb_round_pow2(len) - 1),
+      m_map_len(0), m_fd(-1), m_tail_cache(0), m_head_cache(0)
+{
+    if (name != nullptr) {
+        m_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (m_fd < 0) {
+            fail("shm_open");
+        }
+        m_name = name;
+    } else {
+        m_fd = memfd_create("cb_shm", MFD_CLOEXEC);
+        if (m_fd < 0) {
+            fail("memfd_create");
+        }
+    }
+
+    uint64_t buf_off = (sizeof(cb_shm_header) + CB_CACHE_LINE_SIZE - 1) &
+                       ~(uint64_t)(CB_CACHE_LINE_SIZE - 1);
+    size_t   map_len = buf_off + (m_mask + 1) * sizeof(T);
+
+    if (ftruncate(m_fd, map_len) != 0) {
+        fail("ftruncate");
+    }
+
+    map(map_len);
+
+    // the new object is zero-filled, so m_head and m_tail are 0 already
+    m_hdr->m_version   = CB_SHM_VERSION;
+    m_hdr->m_elem_size = sizeof(T);
+    m_hdr->m_mask      = m_mask;
+    m_hdr->m_buf_off   = buf_off;
+
+    m_buf = reinterpret_cast<T *>(reinterpret_cast<char *>(m_hdr) + buf_off);
+
+    __atomic_store_n(&m_hdr->m_magic, CB_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+template <typename T, typename W>
+inline cb_shm<T, W>::cb_shm(const char *name)
+    : m_hdr(nullptr), m_buf(nullptr), m_mask(0), m_map_len(0), m_fd(-1),
+      m_tail_cache(0), m_head_cache(0)
+{
+    m_fd = shm_open(name, O_RDWR, 0);
+    if (m_fd < 0) {
+        fail("shm_open");
+    }
+
+    attach();
+}
+
+template <typename T, typename W>
+inline cb_shm<T, W>::cb_shm(int fd)
+    : m_hdr(nullptr), m_buf(nullptr), m_mask(0), m_map_len(0), m_fd(-1),
+      m_tail_cache(0), m_head_cache(0)
+{
+    m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (m_fd < 0) {
+        fail("fcntl");
+    }
+
+    attach();
+}
+
+template <typename T, typename W>
+inline cb_shm<T, W>::~cb_shm()
+{
+    if (m_hdr != nullptr) {
+        munmap(m_hdr, m_map_len);
+    }
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+
+    if (! m_name.empty()) {
+        shm_unlink(m_name.c_str());
+    }
+}
+
+// clean up and throw, the destructor does not run for a failed constructor
+template <typename T, typename W>
+inline void cb_shm<T, W>::fail(const char *what)
+{
+    int err = errno;
+
+    if (m_hdr != nullptr) {
+        munmap(m_hdr, m_map_len);
+    }
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+
+    if (! m_name.empty()) {
+        shm_unlink(m_name.c_str());
+    }
+
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+template <typename T, typename W>
+inline void cb_shm<T, W>::map(size_t len)
+{
+    void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+    if (p == MAP_FAILED) {
+        fail("mmap");
+    }
+
+    m_hdr     = static_cast<cb_shm_header *>(p);
+    m_map_len = len;
+}
+
+template <typename T, typename W>
+inline void cb_shm<T, W>::attach()
+{
+    struct stat st;
+
+    if (fstat(m_fd, &st) != 0) {
+        fail("fstat");
+    }
+
+    if ((size_t)st.st_size < sizeof(cb_shm_header)) {
+        errno = EINVAL;
+        fail("cb_shm: region too small");
+    }
+
+    map(st.st_size);
+
+    if (__atomic_load_n(&m_hdr->m_magic, __ATOMIC_ACQUIRE) != CB_SHM_MAGIC) {
+        errno = EINVAL;
+        fail("cb_shm: bad magic");
+    }
+
+    if (m_hdr->m_version != CB_SHM_VERSION ||
+        m_hdr->m_elem_size != sizeof(T)) {
+        errno = EPROTO;
+        fail("cb_shm: version or element size mismatch");
+    }
+
+    // a foreign or corrupt header must not send us out of the mapping
+    uint64_t mask    = m_hdr->m_mask;
+    uint64_t buf_off = m_hdr->m_buf_off;
+
+    if ((mask & (mask + 1)) != 0 || mask >= m_map_len ||
+        buf_off < sizeof(cb_shm_header) || buf_off % alignof(T) != 0 ||
+        buf_off > m_map_len ||
+        mask + 1 > (m_map_len - buf_off) / sizeof(T)) {
+        errno = EINVAL;
+        fail("cb_shm: bad ring geometry");
+    }
+
+    m_mask = mask;
+
+    m_buf = reinterpret_cast<T *>(reinterpret_cast<char *>(m_hdr) + buf_off);
+
+    // the ring may have seen traffic, start the caches where it stands
+    m_tail_cache = __atomic_load_n(&m_hdr->m_tail, __ATOMIC_ACQUIRE);
+    m_head_cache = __atomic_load_n(&m_hdr->m_head, __ATOMIC_ACQUIRE);
+}
+
+// number of values seen by the reader, refreshes its copy of m_tail
+template <typename T, typename W>
+inline size_t cb_shm<T, W>::used_len()
+{
+    m_tail_cache = __atomic_load_n(&m_hdr->m_tail, __ATOMIC_ACQUIRE);
+
+    return m_tail_cache - m_hdr->m_head;
+}
+
+// number of free slots seen by the writer, refreshes its copy of m_head
+template <typename T, typename W>
+inline size_t cb_shm<T, W>::free_len()
+{
+    m_head_cache = __atomic_load_n(&m_hdr->m_head, __ATOMIC_ACQUIRE);
+
+    return m_mask + 1 - (m_hdr->m_tail - m_head_cache);
+}
+
+template <typename T, typename W>
+inline size_t cb_shm<T, W>::get_len()
+{
+    return __atomic_load_n(&m_hdr->m_tail, __ATOMIC_RELAXED) -
+           __atomic_load_n(&m_hdr->m_head, __ATOMIC_RELAXED);
+}
+
+template <typename T, typename W>
+inline T cb_shm<T, W>::pop()
+{
+    uint64_t head = m_hdr->m_head;
+
+    if (head == m_tail_cache) {
+        m_wait_empty.wait([&] { return used_len() != 0; }, &m_hdr->m_tail);
+    }
+
+    T retval = m_buf[head & m_mask];
+
+    __atomic_store_n(&m_hdr->m_head, head + 1, __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return retval;
+}
+
+template <typename T, typename W>
+inline void cb_shm<T, W>::push(const T &val)
+{
+    uint64_t tail = m_hdr->m_tail;
+
+    if (tail - m_head_cache > m_mask) {
+        m_wait_full.wait([&] { return free_len() != 0; }, &m_hdr->m_head);
+    }
+
+    m_buf[tail & m_mask] = val;
+
+    __atomic_store_n(&m_hdr->m_tail, tail + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+}
+
+template <typename T, typename W>
+inline bool cb_shm<T, W>::try_pop(T &val)
+{
+    uint64_t head = m_hdr->m_head;
+
+    if (head == m_tail_cache && used_len() == 0) {
+        return false;
+    }
+
+    val = m_buf[head & m_mask];
+
+    __atomic_store_n(&m_hdr->m_head, head + 1, __ATOMIC_RELEASE);
+
+    m_wait_full.notify();
+
+    return true;
+}
+
+template <typename T, typename W>
+inline bool cb_shm<T, W>::try_push(const T &val)
+{
+    uint64_t tail = m_hdr->m_tail;
+
+    if (tail - m_head_cache > m_mask && free_len() == 0) {
+        return false;
+    }
+
+    m_buf[tail & m_mask] = val;
+
+    __atomic_store_n(&m_hdr->m_tail, tail + 1, __ATOMIC_RELEASE);
+
+    m_wait_empty.notify();
+
+    return true;
+}
+
+#endif // CB_SHM_HPP
@@ -0,0 +1,1122 @@
+#include "cb.hpp"
+#include "cb_bcast.hpp"
+#include "cb_bytes.hpp"
+#include "cb_mpmc.hpp"
+#include "cb_mpsc.hpp"
+#include "cb_seg.hpp"
+#include "cb_shm.hpp"
+#include "reclaim.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// correctness checks for the cb queues and the reclamation domains
+//
+// Every test prints its name and ok or the first failed check, and the
+// exit status tells whether all of them passed. Tests run one after the
+// other, all of them unless some are named on the command line.
+
+#define CHECK(c)                                                          \
+    do {                                                                  \
+        if (! (c)) {                                                      \
+            std::cout << "FAILED at line " << __LINE__ << ": " #c         \
+                      << std::endl;                                       \
+            return false;                                                 \
+        }                                                                 \
+    } while (0)
+
+// global allocation counter, to check that steady state does not allocate
+static uint64_t g_allocs;
+
+// all of them out of line, or gcc pairs an inlined malloc() or free() with
+// the operator on the other side and warns about a mismatch
+__attribute__((noinline)) void *
+operator new(size_t size)
+{
+    __atomic_fetch_add(&g_allocs, 1, __ATOMIC_RELAXED);
+
+    void *p = malloc(size ? size : 1);
+
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+__attribute__((noinline)) void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void
+operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t
+allocs()
+{
+    return __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+}
+
+// a long push/pop run through recycled segments, after warm-up it must
+// neither lose values nor allocate
+template <typename R>
+static bool
+test_seg_steady()
+{
+    const size_t seg_len = 64;
+    const size_t burst   = 1000;
+    cb_seg<uint64_t, cb_wait_busy, R> q(seg_len);
+    uint64_t pushed = 0;
+    uint64_t popped = 0;
+    uint64_t before = 0;
+
+    for (int round = 0; round < 20000; round++) {
+        if (round == 10000)
+            before = allocs();
+
+        for (size_t i = 0; i < burst; i++)
+            q.push(pushed++);
+
+        for (size_t i = 0; i < burst; i++)
+            CHECK(q.pop() == popped++);
+    }
+
+    uint64_t v;
+
+    CHECK(! q.try_pop(v));
+    CHECK(allocs() == before);
+
+    return true;
+}
+
+// the same with a writer and the reader on different threads
+static bool
+test_seg_threads()
+{
+    const uint64_t n = 2000000;
+    cb_seg<uint64_t> q(256);
+    std::thread writer([&] {
+        for (uint64_t i = 0; i < n; i++)
+            q.push(i);
+    });
+
+    bool ok = true;
+
+    for (uint64_t i = 0; i < n; i++)
+        ok = q.pop() == i && ok;
+
+    writer.join();
+
+    CHECK(ok);
+
+    return true;
+}
+
+// every reader sees every value, and the writer waits for the slowest
+static bool
+test_bcast_gated()
+{
+    cb_bcast<uint64_t> q(16, 3);
+    uint64_t v;
+
+    for (uint64_t i = 0; i < 16; i++)
+        CHECK(q.try_push(i));
+
+    CHECK(! q.try_push(16));
+    CHECK(q.get_len(0) == 16);
+
+    for (uint64_t i = 0; i < 16; i++)
+        CHECK(q.pop(0) == i);
+
+    CHECK(! q.try_pop(0, v));
+    // readers 1 and 2 still hold the ring
+    CHECK(! q.try_push(16));
+
+    for (uint64_t i = 0; i < 16; i++) {
+        CHECK(q.pop(1) == i);
+        CHECK(q.try_pop(2, v) && v == i);
+    }
+
+    CHECK(q.try_push(16));
+    CHECK(q.get_overrun(0) == 0);
+
+    // the futex keeps the run short on a single CPU
+    const uint64_t n = 200000;
+    cb_bcast<uint64_t, cb_wait_futex> r(64, 3);
+    bool ok[3] = { true, true, true };
+    std::vector<std::thread> readers;
+
+    for (size_t i = 0; i < 3; i++) {
+        readers.emplace_back([&, i] {
+            for (uint64_t j = 0; j < n; j++)
+                ok[i] = r.pop(i) == j && ok[i];
+        });
+    }
+
+    for (uint64_t j = 0; j < n; j++)
+        r.push(j);
+
+    for (auto &t : readers)
+        t.join();
+
+    CHECK(ok[0] && ok[1] && ok[2]);
+
+    return true;
+}
+
+// the writer never waits, a lapped reader skips ahead and counts the loss
+static bool
+test_bcast_lap()
+{
+    cb_bcast<uint64_t, cb_wait_busy, true> q(8, 2);
+    uint64_t v;
+
+    for (uint64_t i = 0; i < 20; i++)
+        q.push(i);
+
+    // reader 0 lost the oldest values and then reads in order to the end
+    uint64_t got = 0;
+    uint64_t last = 0;
+
+    while (q.try_pop(0, v)) {
+        CHECK(got == 0 || v == last + 1);
+        last = v;
+        got++;
+    }
+
+    CHECK(last == 19);
+    CHECK(got > 0 && got <= 8);
+    CHECK(got + q.get_overrun(0) == 20);
+
+    // reader 1 keeps up from here and loses nothing more
+    uint64_t overrun = 0;
+
+    CHECK(q.try_pop(1, v));
+    overrun = q.get_overrun(1);
+    CHECK(v == overrun);
+
+    while (q.try_pop(1, v))
+        ;
+
+    for (uint64_t i = 20; i < 100; i++) {
+        q.push(i);
+        CHECK(q.try_pop(1, v) && v == i);
+    }
+
+    CHECK(q.get_overrun(1) == overrun);
+
+    return true;
+}
+
+// a second mapping of the same region, by descriptor and by name, sees
+// what the first one pushes, also from a forked process
+static bool
+test_shm_attach()
+{
+    cb_shm<uint64_t> w(nullptr, 100);
+    cb_shm<uint64_t> r(w.get_fd());
+    uint64_t v;
+
+    CHECK(! r.try_pop(v));
+
+    for (uint64_t i = 0; i < 128; i++)
+        CHECK(w.try_push(i));
+
+    CHECK(! w.try_push(128));
+    CHECK(r.get_len() == 128);
+
+    for (uint64_t i = 0; i < 128; i++)
+        CHECK(r.pop() == i);
+
+    char name[64];
+
+    snprintf(name, sizeof(name), "/cb_test.%d", (int)getpid());
+
+    {
+        cb_shm<uint64_t> wn(name, 16);
+        cb_shm<uint64_t> rn(name);
+
+        wn.push(42);
+        CHECK(rn.pop() == 42);
+    }
+
+    // the creator unlinked the name
+    bool gone = false;
+
+    try {
+        cb_shm<uint64_t> rn(name);
+    } catch (const std::system_error &) {
+        gone = true;
+    }
+
+    CHECK(gone);
+
+    const uint64_t n = 20000;
+    pid_t pid = fork();
+
+    CHECK(pid >= 0);
+
+    if (pid == 0) {
+        for (uint64_t i = 0; i < n; i++)
+            w.push(i);
+        _exit(0);
+    }
+
+    bool ok = true;
+
+    for (uint64_t i = 0; i < n; i++)
+        ok = r.pop() == i && ok;
+
+    int status;
+
+    waitpid(pid, &status, 0);
+
+    CHECK(ok);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    return true;
+}
+
+// a reader or writer which attaches after traffic starts where the ring
+// stands, not at position 0
+static bool
+test_shm_attach_late()
+{
+    cb_shm<uint64_t> w(nullptr, 8);
+    uint64_t v;
+
+    {
+        cb_shm<uint64_t> r(w.get_fd());
+
+        for (uint64_t i = 0; i < 5; i++) {
+            w.push(i);
+            CHECK(r.pop() == i);
+        }
+    }
+
+    cb_shm<uint64_t> r(w.get_fd());
+
+    CHECK(! r.try_pop(v));
+    CHECK(r.get_len() == 0);
+
+    w.push(5);
+    CHECK(r.try_pop(v) && v == 5);
+    CHECK(! r.try_pop(v));
+    CHECK(r.get_len() == 0);
+
+    // a second writer on a full ring
+    for (uint64_t i = 0; i < 8; i++)
+        CHECK(w.try_push(i));
+
+    cb_shm<uint64_t> w2(w.get_fd());
+
+    CHECK(! w2.try_push(8));
+    CHECK(r.get_len() == 8);
+
+    return true;
+}
+
+// a header with a foreign geometry is rejected instead of mapped
+static bool
+test_shm_bad_header()
+{
+    cb_shm<uint64_t> w(nullptr, 100);
+    void *p = mmap(nullptr, sizeof(cb_shm_header), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, w.get_fd(), 0);
+
+    CHECK(p != MAP_FAILED);
+
+    cb_shm_header *hdr  = static_cast<cb_shm_header *>(p);
+    uint64_t       mask = hdr->m_mask;
+    uint64_t       bad[] = { 100, 255, UINT64_MAX, 1ULL << 40 };
+
+    for (uint64_t m : bad) {
+        bool rejected = false;
+
+        hdr->m_mask = m;
+
+        try {
+            cb_shm<uint64_t> r(w.get_fd());
+        } catch (const std::system_error &) {
+            rejected = true;
+        }
+
+        CHECK(rejected);
+    }
+
+    hdr->m_mask = mask;
+
+    cb_shm<uint64_t> r(w.get_fd());
+
+    munmap(p, sizeof(cb_shm_header));
+
+    return true;
+}
+
+// a record which does not fit before the end of the buffer is preceded by
+// a pad record, which the reader skips without seeing it
+static bool
+test_bytes_wrap()
+{
+    cb_bytes<> q(256);
+    char buf[256];
+    char out[256];
+
+    // 5 records of 48 bytes with their header, 16 bytes left at the end
+    for (int i = 0; i < 5; i++) {
+        memset(buf, 'a' + i, 40);
+        q.push(buf, 40);
+    }
+
+    CHECK(q.get_len() == 240);
+
+    for (int i = 0; i < 3; i++) {
+        CHECK(q.pop(out, sizeof(out)) == 40);
+        CHECK(out[0] == 'a' + i && out[39] == 'a' + i);
+    }
+
+    // 16 bytes of pad, then the record from the start of the buffer
+    cb_span<char> span = q.try_reserve(40);
+
+    CHECK(span.ptr != nullptr && span.len == 40);
+    memset(span.ptr, 'x', 40);
+    q.commit(40);
+
+    CHECK(q.get_len() == 96 + 16 + 48);
+
+    // no room for another one until the reader moves on
+    CHECK(q.try_reserve(100).ptr == nullptr);
+
+    for (int i = 3; i < 5; i++) {
+        CHECK(q.pop(out, sizeof(out)) == 40);
+        CHECK(out[0] == 'a' + i && out[39] == 'a' + i);
+    }
+
+    cb_span<const char> rec = q.try_peek();
+
+    CHECK(rec.len == 40 && rec.ptr[0] == 'x' && rec.ptr[39] == 'x');
+    q.consume();
+
+    CHECK(q.get_len() == 0);
+    CHECK(q.try_peek().ptr == nullptr);
+
+    // commit() may shorten the reserved record
+    span = q.reserve(100);
+    memcpy(span.ptr, "short", 5);
+    q.commit(5);
+    CHECK(q.pop(out, sizeof(out)) == 5 && memcmp(out, "short", 5) == 0);
+
+    bool too_long = false;
+
+    try {
+        q.try_reserve(256 - sizeof(cb_bytes_hdr) + 1);
+    } catch (const std::length_error &) {
+        too_long = true;
+    }
+
+    CHECK(too_long);
+
+    bool too_big = false;
+
+    try {
+        cb_bytes<> r((size_t)UINT32_MAX + 2);
+    } catch (const std::length_error &) {
+        too_big = true;
+    }
+
+    CHECK(too_big);
+
+    // records of every length wrap at every offset, across threads. the
+    // futex keeps the run short on a single CPU
+    const int n = 200000;
+    cb_bytes<cb_wait_futex> t(1024);
+    std::thread writer([&] {
+        char w[200];
+
+        for (int i = 0; i < n; i++) {
+            size_t len = i % 200;
+
+            memset(w, i, len);
+            t.push(w, len);
+        }
+    });
+
+    bool ok = true;
+
+    for (int i = 0; i < n; i++) {
+        cb_span<const char> r = t.peek();
+
+        ok = r.len == (size_t)(i % 200) && ok;
+
+        for (size_t j = 0; j < r.len; j++)
+            ok = r.ptr[j] == (char)i && ok;
+
+        t.consume();
+    }
+
+    writer.join();
+
+    CHECK(ok);
+
+    return true;
+}
+
+// single-threaded edges of cb_mpsc, then writers whose values carry their
+// id and sequence so the reader can check that none is lost or reordered
+static bool
+test_mpsc_order()
+{
+    cb_mpsc<uint64_t> q(5);
+    uint64_t v;
+
+    CHECK(! q.try_pop(v));
+
+    // the capacity is rounded up to 8
+    for (uint64_t i = 0; i < 8; i++)
+        CHECK(q.try_push(i));
+
+    CHECK(! q.try_push(8));
+    CHECK(q.get_len() == 8);
+
+    CHECK(q.front() == 0);
+    q.release();
+    CHECK(q.try_push(8));
+
+    for (uint64_t i = 1; i < 9; i++) {
+        CHECK(q.try_pop(v) && v == i);
+    }
+
+    CHECK(! q.try_pop(v));
+    CHECK(q.get_len() == 0);
+
+    const int writers = 4;
+    const uint64_t n = 50000;
+    cb_mpsc<uint64_t, cb_wait_futex> t(64);
+    std::vector<std::thread> threads;
+
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&t, w, n] {
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t tag = (uint64_t)w << 32 | i;
+
+                // some values through the non-blocking path as well
+                if (i % 2 == 0 || ! t.try_push(tag))
+                    t.push(tag);
+            }
+        });
+    }
+
+    uint64_t next[writers] = { };
+    bool ok = true;
+
+    for (uint64_t i = 0; i < writers * n; i++) {
+        uint64_t tag = t.pop();
+        uint64_t w = tag >> 32;
+
+        ok = w < writers && (tag & UINT32_MAX) == next[w]++ && ok;
+    }
+
+    for (std::thread &th : threads)
+        th.join();
+
+    CHECK(ok);
+
+    for (int w = 0; w < writers; w++)
+        CHECK(next[w] == n);
+
+    CHECK(! t.try_pop(v));
+
+    return true;
+}
+
+// the index policies agree on slots and distances across their own wrap
+// points: 2 * size positions for cb_index_exact, 2^64 for cb_index_pow2
+static bool
+test_index_policies()
+{
+    cb_index_exact e(5);
+    uint64_t pos = 0;
+
+    CHECK(e.size() == 5);
+
+    for (uint64_t i = 0; i < 40; i++) {
+        uint64_t next = e.next(pos, 3);
+
+        CHECK(pos < 10 && e.slot(pos) == i * 3 % 5);
+        CHECK(e.distance(pos, next) == 3);
+        CHECK(e.distance(pos, pos) == 0);
+        CHECK(e.distance(pos, e.next(pos, 5)) == 5);
+        pos = next;
+    }
+
+    cb_index_pow2 p(5);
+    uint64_t head = UINT64_MAX - 2;
+
+    CHECK(p.size() == 8);
+    CHECK(p.slot(head) == 5);
+    CHECK(p.slot(p.next(head, 4)) == 1);
+    CHECK(p.distance(head, p.next(head, 8)) == 8);
+
+    CHECK(cb_round_pow2(1) == 1);
+    CHECK(cb_round_pow2(5) == 8);
+    CHECK(cb_round_pow2((size_t)1 << 63) == (size_t)1 << 63);
+
+    bool too_big = false;
+
+    try {
+        cb_round_pow2(((size_t)1 << 63) + 1);
+    } catch (const std::length_error &) {
+        too_big = true;
+    }
+
+    CHECK(too_big);
+
+    return true;
+}
+
+// push_n()/pop_n() and reserve()/peek() with the ring started at every
+// slot, so every batch length wraps at every offset. five slots stay five
+// with cb_index_exact and become eight with cb_index_pow2
+template <template <typename, typename, typename> class Q, typename I>
+static bool
+test_bulk_wrap()
+{
+    Q<uint64_t, cb_wait_busy, I> probe(5);
+    const size_t size = probe.reserve(100).len;
+
+    CHECK(size == 5 || size == 8);
+
+    for (size_t start = 0; start < size; start++) {
+        for (size_t n = 1; n <= size; n++) {
+            Q<uint64_t, cb_wait_busy, I> q(5);
+            uint64_t in[8], out[8];
+            uint64_t v;
+
+            for (size_t i = 0; i < start; i++) {
+                q.push(i);
+                CHECK(q.try_pop(v) && v == i);
+            }
+
+            for (size_t i = 0; i < n; i++)
+                in[i] = 100 + i;
+
+            q.push_n(in, n);
+            CHECK(q.get_len() == n);
+            CHECK(q.pop_n(out, size) == n);
+            CHECK(memcmp(in, out, n * sizeof(uint64_t)) == 0);
+
+            // reserve() stops at the end of the buffer, the rest of the
+            // batch comes from its start
+            size_t pos = (start + n) % size;
+            size_t first = size - pos < n ? size - pos : n;
+            cb_span<uint64_t> span = q.reserve(n);
+
+            CHECK(span.len == first && span.ptr != nullptr);
+            std::copy(in, in + first, span.ptr);
+            q.commit(first);
+
+            span = q.reserve(n - first);
+            CHECK(span.len == n - first);
+            std::copy(in + first, in + n, span.ptr);
+            q.commit(n - first);
+
+            CHECK(q.get_len() == n);
+
+            cb_span<const uint64_t> got = q.peek(size);
+
+            CHECK(got.len == first);
+            CHECK(std::equal(got.ptr, got.ptr + first, in));
+            q.consume(first);
+
+            got = q.peek(size);
+            CHECK(got.len == n - first);
+            CHECK(std::equal(got.ptr, got.ptr + n - first, in + first));
+            q.consume(n - first);
+
+            CHECK(q.get_len() == 0);
+            CHECK(q.peek(size).len == 0);
+        }
+    }
+
+    // batches of every length against a smaller ring across threads
+    const uint64_t total = 200000;
+    Q<uint64_t, cb_wait_futex, I> t(100);
+    std::thread writer([&t, total] {
+        uint64_t vals[37];
+        uint64_t next = 0;
+
+        for (size_t len = 1; next < total; len = len % 37 + 1) {
+            if (len > total - next)
+                len = total - next;
+
+            for (size_t i = 0; i < len; i++)
+                vals[i] = next++;
+
+            t.push_n(vals, len);
+        }
+    });
+
+    uint64_t vals[64];
+    uint64_t next = 0;
+    bool ok = true;
+
+    while (next < total) {
+        size_t len = t.pop_n(vals, 64);
+
+        for (size_t i = 0; i < len; i++)
+            ok = vals[i] == next++ && ok;
+    }
+
+    writer.join();
+
+    CHECK(ok);
+
+    return true;
+}
+
+// a value large enough to be filled and read in place
+struct claim_test_val {
+    uint64_t m_word[16];
+};
+
+// claim()/publish() and front()/release(): nothing is visible before the
+// publish, and the reader sees every word the writer filled in place
+template <template <typename, typename, typename> class Q, typename I>
+static bool
+test_claim_publish()
+{
+    Q<claim_test_val, cb_wait_busy, I> q(3);
+    claim_test_val v;
+
+    claim_test_val &c = q.claim();
+
+    c.m_word[0] = 7;
+    CHECK(q.get_len() == 0);
+    CHECK(! q.try_pop(v));
+
+    q.publish();
+    CHECK(q.get_len() == 1);
+    CHECK(q.front().m_word[0] == 7);
+    q.release();
+    CHECK(q.get_len() == 0);
+
+    const uint64_t n = 100000;
+    Q<claim_test_val, cb_wait_futex, I> t(16);
+    std::thread writer([&t, n] {
+        for (uint64_t i = 0; i < n; i++) {
+            claim_test_val &s = t.claim();
+
+            for (uint64_t &w : s.m_word)
+                w = i;
+
+            t.publish();
+        }
+    });
+
+    bool ok = true;
+
+    for (uint64_t i = 0; i < n; i++) {
+        const claim_test_val &s = t.front();
+
+        for (uint64_t w : s.m_word)
+            ok = w == i && ok;
+
+        t.release();
+    }
+
+    writer.join();
+
+    CHECK(ok);
+
+    return true;
+}
+
+// cb_wait_futex parks a reader on an empty ring and a writer on a full
+// one until the other side moves, and the try_* calls never park
+template <template <typename, typename, typename> class Q, typename I>
+static bool
+test_futex_wake()
+{
+    Q<uint64_t, cb_wait_futex, I> q(4);
+    uint64_t v;
+
+    CHECK(! q.try_pop(v));
+
+    for (uint64_t i = 0; i < 4; i++)
+        CHECK(q.try_push(i));
+
+    CHECK(! q.try_push(4));
+
+    for (uint64_t i = 0; i < 4; i++)
+        CHECK(q.try_pop(v) && v == i);
+
+    CHECK(! q.try_pop(v));
+
+    // the reader is parked long before the value arrives
+    uint64_t got = 0;
+    std::thread reader([&q, &got] {
+        __atomic_store_n(&got, q.pop(), __ATOMIC_RELEASE);
+    });
+
+    usleep(20000);
+    CHECK(__atomic_load_n(&got, __ATOMIC_ACQUIRE) == 0);
+    q.push(42);
+    reader.join();
+    CHECK(got == 42);
+
+    // and the writer on a full ring until a slot is freed
+    bool pushed = false;
+
+    for (uint64_t i = 0; i < 4; i++)
+        q.push(i);
+
+    std::thread writer([&q, &pushed] {
+        q.push(4);
+        __atomic_store_n(&pushed, true, __ATOMIC_RELEASE);
+    });
+
+    usleep(20000);
+    CHECK(! __atomic_load_n(&pushed, __ATOMIC_ACQUIRE));
+    CHECK(q.pop() == 0);
+    writer.join();
+    CHECK(pushed);
+
+    for (uint64_t i = 1; i < 5; i++)
+        CHECK(q.pop() == i);
+
+    // a ping-pong parks both sides on every round, a lost wake-up hangs
+    const uint64_t rounds = 5000;
+    Q<uint64_t, cb_wait_futex, I> ping(1);
+    Q<uint64_t, cb_wait_futex, I> pong(1);
+    std::thread echo([&ping, &pong, rounds] {
+        for (uint64_t i = 0; i < rounds; i++)
+            pong.push(ping.pop() + 1);
+    });
+
+    bool ok = true;
+
+    for (uint64_t i = 0; i < rounds; i++) {
+        ping.push(i);
+        ok = pong.pop() == i + 1 && ok;
+    }
+
+    echo.join();
+
+    CHECK(ok);
+
+    return true;
+}
+
+// cb_spsc trusts its cached copy of the other side's index only until it
+// says full or empty, then re-reads the shared one
+template <typename I>
+static bool
+test_spsc_cache()
+{
+    cb_spsc<uint64_t, cb_wait_busy, I> q(4);
+    uint64_t v;
+
+    // the reader's cache says empty, a push behind its back is still seen
+    CHECK(! q.try_pop(v));
+    q.push(1);
+    CHECK(q.try_pop(v) && v == 1);
+
+    // the writer's cache says full, a pop behind its back frees a slot
+    for (uint64_t i = 0; i < 4; i++)
+        CHECK(q.try_push(10 + i));
+
+    CHECK(! q.try_push(99));
+    CHECK(q.pop() == 10);
+    CHECK(q.try_push(14));
+    CHECK(! q.try_push(99));
+
+    for (uint64_t i = 11; i < 15; i++)
+        CHECK(q.try_pop(v) && v == i);
+
+    CHECK(! q.try_pop(v));
+
+    // the caches also go stale across many laps of a small ring
+    for (uint64_t i = 0; i < 1000; i++) {
+        CHECK(q.try_push(i) && q.try_push(i + 1));
+        CHECK(q.try_pop(v) && v == i);
+        CHECK(q.try_pop(v) && v == i + 1);
+    }
+
+    // the index and each side's fields stay on their own cache lines
+    CHECK(sizeof(q) >= 5 * CB_CACHE_LINE_SIZE);
+
+    return true;
+}
+
+// cb_mpmc hands every value to exactly one of the readers, whichever of
+// push()/try_push() and pop()/try_pop() the threads use
+static bool
+test_mpmc_once()
+{
+    cb_mpmc<uint64_t> q(4);
+    uint64_t v;
+
+    CHECK(! q.try_pop(v));
+
+    for (uint64_t i = 0; i < 4; i++)
+        CHECK(q.try_push(i));
+
+    CHECK(! q.try_push(4));
+    CHECK(q.get_len() == 4);
+
+    for (uint64_t i = 0; i < 4; i++)
+        CHECK(q.try_pop(v) && v == i);
+
+    CHECK(! q.try_pop(v));
+    CHECK(q.get_len() == 0);
+
+    const int writers = 4;
+    const int readers = 3;
+    const uint64_t n = 30000;
+    const uint64_t total = writers * n;
+    cb_mpmc<uint64_t, cb_wait_futex> t(64);
+    std::vector<uint8_t> seen(total, 0);
+    std::vector<std::thread> threads;
+
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&t, w, n] {
+            for (uint64_t i = w * n; i < (w + 1) * n; i++) {
+                if (i % 2 == 0 || ! t.try_push(i))
+                    t.push(i);
+            }
+        });
+    }
+
+    for (int r = 0; r < readers; r++) {
+        threads.emplace_back([&t, &seen, total, readers] {
+            for (uint64_t i = 0; i < total / readers; i++) {
+                uint64_t val;
+
+                if (i % 2 == 0 || ! t.try_pop(val))
+                    val = t.pop();
+
+                if (val < total)
+                    __atomic_fetch_add(&seen[val], 1, __ATOMIC_RELAXED);
+            }
+        });
+    }
+
+    for (std::thread &th : threads)
+        th.join();
+
+    for (uint64_t i = 0; i < total; i++)
+        CHECK(seen[i] == 1);
+
+    CHECK(! t.try_pop(v));
+    CHECK(t.get_len() == 0);
+
+    return true;
+}
+
+// node which counts the live instances and tells when it is freed
+struct reclaim_test_node {
+    reclaim_test_node(bool *freed = nullptr) : m_val(42), m_freed(freed)
+    {
+        __atomic_fetch_add(&s_live, 1, __ATOMIC_RELAXED);
+    }
+
+    ~reclaim_test_node()
+    {
+        m_val = 0;
+
+        if (m_freed != nullptr)
+            *m_freed = true;
+
+        __atomic_fetch_sub(&s_live, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t m_val;
+    bool    *m_freed;
+
+    static int64_t s_live;
+};
+
+int64_t reclaim_test_node::s_live;
+
+// retired nodes are freed once no guard protects them, not before, and
+// the domain frees the rest when it is destroyed
+template <typename R>
+static bool
+test_reclaim_counts()
+{
+    typedef reclaim_test_node node;
+
+    const size_t n = 4 * R::batch();
+    bool outer_freed = false;
+    bool inner_freed = false;
+
+    CHECK(node::s_live == 0);
+
+    {
+        R      domain;
+        node  *outer_src = new node(&outer_freed);
+        node  *inner_src = new node(&inner_freed);
+        node  *inner_node = inner_src;
+
+        {
+            typename R::guard g(domain);
+            node *outer = g.protect(0, &outer_src);
+
+            {
+                // an inner guard must not drop the protection of the outer
+                typename R::guard g2(domain);
+                node *inner = g2.protect(0, &inner_src);
+
+                CHECK(inner->m_val == 42);
+            }
+
+            outer_src = nullptr;
+            inner_src = nullptr;
+            domain.retire(outer);
+
+            for (size_t i = 0; i < n; i++)
+                domain.retire(new node);
+
+            CHECK(! outer_freed);
+            CHECK(outer->m_val == 42);
+        }
+
+        // the inner node was never retired, the outer one is unprotected
+        for (size_t i = 0; i < n; i++)
+            domain.retire(new node);
+
+        CHECK(outer_freed);
+        CHECK(! inner_freed);
+        // at most a batch or two are pending in this thread
+        CHECK(node::s_live <= (int64_t)(2 * R::batch() + 1));
+
+        // left to the destructor of the domain
+        domain.retire(inner_node);
+    }
+
+    CHECK(inner_freed);
+
+    CHECK(node::s_live == 0);
+
+    // a writer replaces and retires the node the readers are looking at
+    {
+        R     domain;
+        node *src = new node;
+        bool  ok  = true;
+        bool  done = false;
+        std::vector<std::thread> readers;
+
+        for (int i = 0; i < 2; i++) {
+            readers.emplace_back([&] {
+                bool mine = true;
+
+                while (! __atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+                    typename R::guard g(domain);
+                    node *p = g.protect(0, &src);
+
+                    mine = p->m_val == 42 && mine;
+                }
+
+                if (! mine)
+                    __atomic_store_n(&ok, false, __ATOMIC_RELAXED);
+            });
+        }
+
+        for (int i = 0; i < 100000; i++) {
+            node *old = __atomic_exchange_n(&src, new node, __ATOMIC_ACQ_REL);
+
+            domain.retire(old);
+        }
+
+        __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+
+        for (auto &t : readers)
+            t.join();
+
+        CHECK(ok);
+
+        delete src;
+    }
+
+    CHECK(node::s_live == 0);
+
+    return true;
+}
+
+struct test {
+    const char *m_name;
+    bool      (*m_run)();
+};
+
+static const test tests[] = {
+    { "bcast_gated",      test_bcast_gated },
+    { "bcast_lap",        test_bcast_lap },
+    { "bytes_wrap",       test_bytes_wrap },
+    { "index_policies",   test_index_policies },
+    { "cb_bulk_exact",    test_bulk_wrap<cb, cb_index_exact> },
+    { "cb_bulk_pow2",     test_bulk_wrap<cb, cb_index_pow2> },
+    { "spsc_bulk_exact",  test_bulk_wrap<cb_spsc, cb_index_exact> },
+    { "spsc_bulk_pow2",   test_bulk_wrap<cb_spsc, cb_index_pow2> },
+    { "cb_claim_exact",   test_claim_publish<cb, cb_index_exact> },
+    { "cb_claim_pow2",    test_claim_publish<cb, cb_index_pow2> },
+    { "spsc_claim_exact", test_claim_publish<cb_spsc, cb_index_exact> },
+    { "spsc_claim_pow2",  test_claim_publish<cb_spsc, cb_index_pow2> },
+    { "cb_futex_exact",   test_futex_wake<cb, cb_index_exact> },
+    { "cb_futex_pow2",    test_futex_wake<cb, cb_index_pow2> },
+    { "spsc_futex_exact", test_futex_wake<cb_spsc, cb_index_exact> },
+    { "spsc_futex_pow2",  test_futex_wake<cb_spsc, cb_index_pow2> },
+    { "spsc_cache_exact", test_spsc_cache<cb_index_exact> },
+    { "spsc_cache_pow2",  test_spsc_cache<cb_index_pow2> },
+    { "mpmc_once",        test_mpmc_once },
+    { "mpsc_order",       test_mpsc_order },
+    { "shm_attach",       test_shm_attach },
+    { "shm_attach_late",  test_shm_attach_late },
+    { "shm_bad_header",   test_shm_bad_header },
+    { "seg_steady_ebr",   test_seg_steady<ebr> },
+    { "seg_steady_hp",    test_seg_steady<hazard_ptr> },
+    { "seg_threads",      test_seg_threads },
+    { "reclaim_ebr",      test_reclaim_counts<ebr> },
+    { "reclaim_hp",       test_reclaim_counts<hazard_ptr> },
+};
+
+int
+main(int argc, char *argv[])
+{
+    bool ok = true;
+
+    for (const test &t : tests) {
+        bool selected = argc < 2;
+
+        for (int i = 1; i < argc; i++)
+            selected = selected || t.m_name == std::string(argv[i]);
+
+        if (! selected)
+            continue;
+
+        std::cout << "test = " << t.m_name << std::endl;
+
+        if (t.m_run())
+            std::cout << "ok" << std::endl;
+        else
+            ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
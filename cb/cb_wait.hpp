@@ -0,0 +1,201 @@
+#ifndef CB_WAIT_HPP
+#define CB_WAIT_HPP
+
+#include "cpu_features.hpp"
+#include "pause.hpp"
+
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// wait strategies for the blocking operations of the cb queues
+//
+// A queue keeps one strategy object per condition it blocks on. The waiting
+// side calls wait(pred, addr) which returns once pred() is true, and the
+// other side calls notify() after every publish. addr is the word the other
+// side writes to make pred() true; only cb_wait_umwait uses it. Only
+// cb_wait_futex does any work in notify(), so the spinning strategies cost
+// nothing on the fast path.
+
+// spin on the condition only. lowest latency, burns a full core
+class cb_wait_busy {
+public:
+    template <typename P>
+    void wait(P pred, const void * = nullptr) { while (! pred()); }
+    void notify() { }
+};
+
+// spin with a pause in every iteration, which yields pipeline resources
+// to the SMT sibling
+class cb_wait_pause {
+public:
+    template <typename P>
+    void wait(P pred, const void * = nullptr)
+    {
+        while (! pred())
+            _MM_PAUSE();
+    }
+    void notify() { }
+};
+
+// spin with exponentially growing runs of pauses between checks
+class cb_wait_backoff {
+public:
+    template <typename P>
+    void wait(P pred, const void * = nullptr)
+    {
+        unsigned n = 1;
+
+        while (! pred()) {
+            for (unsigned i = 0; i < n; i++)
+                _MM_PAUSE();
+
+            if (n < CB_WAIT_BACKOFF_MAX)
+                n <<= 1;
+        }
+    }
+    void notify() { }
+
+private:
+    static const unsigned CB_WAIT_BACKOFF_MAX = 1024;
+};
+
+// spin for a while, then sleep on a futex until the other side notifies.
+// for background queues which should not keep a core busy while idle
+class cb_wait_futex {
+public:
+    cb_wait_futex() : m_seq(0), m_waiters(0) { }
+
+    template <typename P>
+    void wait(P pred, const void * = nullptr)
+    {
+        for (unsigned i = 0; i < CB_WAIT_SPIN; i++) {
+            if (pred())
+                return;
+            _MM_PAUSE();
+        }
+
+        for (;;) {
+            uint32_t seq = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+
+            // register before the last check so that a publish after it
+            // either sees us in notify() or changes m_seq
+            __atomic_fetch_add(&m_waiters, 1, __ATOMIC_SEQ_CST);
+
+            if (pred()) {
+                __atomic_fetch_sub(&m_waiters, 1, __ATOMIC_RELAXED);
+                return;
+            }
+
+            syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, seq,
+                    nullptr, nullptr, 0);
+
+            __atomic_fetch_sub(&m_waiters, 1, __ATOMIC_RELAXED);
+
+            if (pred())
+                return;
+        }
+    }
+
+    void notify()
+    {
+        // order the publish before reading m_waiters
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&m_waiters, __ATOMIC_RELAXED) == 0)
+            return;
+
+        __atomic_fetch_add(&m_seq, 1, __ATOMIC_RELEASE);
+
+        // wake everybody, a woken waiter which loses the race parks again
+        syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                nullptr, nullptr, 0);
+    }
+
+private:
+    static const unsigned CB_WAIT_SPIN = 1024;
+
+    uint32_t m_seq;
+    uint32_t m_waiters;
+};
+
+// arm umonitor on the line the other side writes and umwait until it is
+// written, or for CB_WAIT_UMWAIT_TSC cycles at most in case the write went
+// to another line. umwait uses the light C0.1 state, which wakes within
+// well under a microsecond and hands the core to the SMT sibling meanwhile.
+// Without an address tpause naps for short periods instead, and without
+// WAITPKG this is cb_wait_pause.
+class cb_wait_umwait {
+public:
+    cb_wait_umwait() : m_waitpkg(cpu_get_features().m_waitpkg) { }
+
+    template <typename P>
+    void wait(P pred, const void *addr = nullptr)
+    {
+        if (! m_waitpkg) {
+            while (! pred())
+                _MM_PAUSE();
+            return;
+        }
+
+#if defined(__x86_64__)
+        while (! pred()) {
+            if (addr == nullptr) {
+                tpause(CB_WAIT_TPAUSE_TSC);
+                continue;
+            }
+
+            umonitor(addr);
+
+            // the write may have landed before the monitor was armed
+            if (pred())
+                return;
+
+            umwait(CB_WAIT_UMWAIT_TSC);
+        }
+#endif // __x86_64__
+    }
+
+    void notify() { }
+
+private:
+    static const uint64_t CB_WAIT_UMWAIT_TSC = 100000;
+    static const uint64_t CB_WAIT_TPAUSE_TSC = 1000;
+    static const uint32_t CB_WAIT_C01        = 1; // C0.1 rather than C0.2
+
+    bool m_waitpkg;
+
+#if defined(__x86_64__)
+    // WAITPKG by mnemonic, so no -mwaitpkg or intrinsics header is needed
+    static void umonitor(const void *addr)
+    {
+        asm volatile ("umonitor %0" : : "r" (addr) : "memory");
+    }
+
+    static void umwait(uint64_t tsc)
+    {
+        uint64_t deadline = __builtin_ia32_rdtsc() + tsc;
+
+        asm volatile ("umwait %0"
+                      :
+                      : "r" (CB_WAIT_C01), "a" ((uint32_t)deadline),
+                        "d" ((uint32_t)(deadline >> 32))
+                      : "cc", "memory");
+    }
+
+    static void tpause(uint64_t tsc)
+    {
+        uint64_t deadline = __builtin_ia32_rdtsc() + tsc;
+
+        asm volatile ("tpause %0"
+                      :
+                      : "r" (CB_WAIT_C01), "a" ((uint32_t)deadline),
+                        "d" ((uint32_t)(deadline >> 32))
+                      : "cc", "memory");
+    }
+#endif // __x86_64__
+};
+
+#endif // CB_WAIT_HPP
@@ -0,0 +1,98 @@
+#ifndef CLH_LOCK_HPP
+#define CLH_LOCK_HPP
+
+#include "pause.hpp"
+
+class clh_lock_ac;
+
+// queue lock by Craig, Landin and Hagersten. a waiter enqueues a node with
+// one exchange and spins on the node of its predecessor. nodes are not tied
+// to a lock, the acquirer takes over the predecessor's node once it holds
+// the lock, so each thread keeps a small pool of them.
+class clh_lock {
+public:
+    typedef clh_lock_ac guard;
+
+    clh_lock() : m_tail(new node) { m_tail->m_locked = 0; }
+    ~clh_lock() { delete m_tail; }
+
+private:
+    // padded rather than aligned, plain new cannot over-align before C++17
+    struct node {
+        int   m_locked;
+        node *m_next_free;
+        char  m_pad[64 - sizeof(int) - sizeof(node *)];
+    };
+
+    // per-thread free list of nodes
+    class pool {
+    public:
+        pool() : m_free(nullptr) { }
+        ~pool()
+        {
+            while (m_free != nullptr) {
+                node *n = m_free;
+                m_free = n->m_next_free;
+                delete n;
+            }
+        }
+
+        node *get()
+        {
+            if (m_free == nullptr)
+                return new node;
+
+            node *n = m_free;
+            m_free = n->m_next_free;
+
+            return n;
+        }
+
+        void put(node *n)
+        {
+            n->m_next_free = m_free;
+            m_free = n;
+        }
+
+        static pool &local()
+        {
+            static thread_local pool p;
+            return p;
+        }
+
+    private:
+        node *m_free;
+    };
+
+    node *m_tail;
+
+    friend class clh_lock_ac;
+};
+
+class clh_lock_ac {
+public:
+    clh_lock_ac(clh_lock &lock) : m_node(clh_lock::pool::local().get())
+    {
+        __atomic_store_n(&m_node->m_locked, 1, __ATOMIC_RELAXED);
+
+        clh_lock::node *pred = __atomic_exchange_n(&lock.m_tail, m_node,
+                                                   __ATOMIC_ACQ_REL);
+
+        while (__atomic_load_n(&pred->m_locked, __ATOMIC_ACQUIRE))
+            _MM_PAUSE(); // busy-wait
+
+        // nobody else refers to the predecessor's node any more
+        clh_lock::pool::local().put(pred);
+    }
+
+    ~clh_lock_ac()
+    {
+        // the successor, or the lock if there is none, now owns m_node
+        __atomic_store_n(&m_node->m_locked, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    clh_lock::node *m_node;
+};
+
+#endif // CLH_LOCK_HPP
@@ -0,0 +1,80 @@
+#ifndef COHORT_LOCK_HPP
+#define COHORT_LOCK_HPP
+
+#include "ticket_lock.hpp"
+
+#include <sched.h>
+#include <stdint.h>
+
+#define COHORT_MAX_NODES 8  // NUMA nodes beyond this share local locks
+#define COHORT_MAX_PASS  64 // hand-overs within a node before going global
+
+class cohort_lock_ac;
+
+// NUMA-aware lock built from ticket locks (C-TKT-TKT by Dice et al.)
+//
+// A thread first takes the local lock of its NUMA node and then the global
+// lock. On release the global lock is passed on to the next waiter of the
+// same node, without touching the global lock, up to COHORT_MAX_PASS times
+// in a row. The lock and its data thus stay on one socket for a while.
+class cohort_lock {
+public:
+    typedef cohort_lock_ac guard;
+
+    cohort_lock() { }
+    ~cohort_lock() { }
+
+private:
+    struct alignas(64) local {
+        local() : m_global(false), m_pass(0) { }
+
+        ticket_lock m_lock;
+        bool        m_global; // the global lock was passed to the cohort
+        uint32_t    m_pass;
+    };
+
+    ticket_lock m_global;
+    local       m_local[COHORT_MAX_NODES];
+
+    friend class cohort_lock_ac;
+};
+
+class cohort_lock_ac {
+public:
+    cohort_lock_ac(cohort_lock &lock) : m_cohort_lock(lock)
+    {
+        unsigned cpu, node;
+
+        if (getcpu(&cpu, &node) != 0)
+            node = 0;
+
+        // remember the node, the thread may migrate while holding the lock
+        m_local = &lock.m_local[node % COHORT_MAX_NODES];
+
+        m_local->m_lock.lock();
+
+        if (! m_local->m_global)
+            lock.m_global.lock();
+    }
+
+    ~cohort_lock_ac()
+    {
+        if (m_local->m_lock.has_waiters() &&
+            m_local->m_pass < COHORT_MAX_PASS) {
+            m_local->m_pass++;
+            m_local->m_global = true;
+        } else {
+            m_local->m_pass   = 0;
+            m_local->m_global = false;
+            m_cohort_lock.m_global.unlock();
+        }
+
+        m_local->m_lock.unlock();
+    }
+
+private:
+    cohort_lock        &m_cohort_lock;
+    cohort_lock::local *m_local;
+};
+
+#endif // COHORT_LOCK_HPP
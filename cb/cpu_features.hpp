@@ -0,0 +1,121 @@
+#ifndef CPU_FEATURES_HPP
+#define CPU_FEATURES_HPP
+
+#ifdef __x86_64__
+    #include "tsx-cpuid.h"
+#endif // __x86_64__
+
+#include <stdint.h>
+
+// CPU features probed once per process
+//
+// AVX2 and AVX-512 are only reported when the OS also saves the wider
+// registers. The locks and wait strategies pick their path from these bits
+// at construction: rtm_lock and rtm_rw_lock elide only with RTM and
+// cb_wait_umwait falls back to pause without WAITPKG.
+//
+// Code that has a faster kernel for some feature compiles it with
+// CPU_TARGET() and picks it once through cpu_select(), as cb_copy_bytes()
+// does for the bulk copies of the queues:
+//
+//     CPU_TARGET("avx2") static void copy_avx2(...);
+//     static void copy_portable(...);
+//
+//     static auto const copy = cpu_select(cpu_get_features().m_avx2,
+//                                         copy_avx2, copy_portable);
+//
+// so a single binary runs everywhere and still uses the wider units.
+
+#define CPUID_1_ECX_OSXSAVE      (1 << 27)
+#define CPUID_7_EBX_AVX2         (1 << 5)
+#define CPUID_7_EBX_BMI2         (1 << 8)
+#define CPUID_7_EBX_AVX512F      (1 << 16)
+#define CPUID_7_EBX_CLFLUSHOPT   (1 << 23)
+#define CPUID_7_ECX_WAITPKG      (1 << 5)
+#define CPUID_7_ECX_MOVDIR64B    (1 << 28)
+#define CPUID_80000001_ECX_LZCNT (1 << 5)
+
+#define XCR0_AVX    0x06 // XMM and YMM state
+#define XCR0_AVX512 0xe6 // and opmask, ZMM_Hi256 and Hi16_ZMM state
+
+#if defined(__x86_64__) || defined(__i686__)
+    #define CPU_TARGET(t) __attribute__((target(t)))
+#else
+    #define CPU_TARGET(t)
+#endif // __x86_64__ || __i686__
+
+struct cpu_features {
+    cpu_features();
+
+    bool m_rtm;
+    bool m_lzcnt;
+    bool m_bmi2;
+    bool m_avx2;
+    bool m_avx512f;
+    bool m_waitpkg;    // umonitor, umwait and tpause
+    bool m_clflushopt;
+    bool m_movdir64b;
+};
+
+inline cpu_features::cpu_features()
+    : m_rtm(false), m_lzcnt(false), m_bmi2(false), m_avx2(false),
+      m_avx512f(false), m_waitpkg(false), m_clflushopt(false),
+      m_movdir64b(false)
+{
+#ifdef __x86_64__
+    unsigned a, b, c, d;
+    uint64_t xcr0 = 0;
+
+    __cpuid(1, a, b, c, d);
+
+    if (c & CPUID_1_ECX_OSXSAVE) {
+        uint32_t lo, hi;
+
+        asm volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+        xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+
+        m_rtm        = b & CPUID_RTM;
+        m_bmi2       = b & CPUID_7_EBX_BMI2;
+        m_avx2       = (b & CPUID_7_EBX_AVX2) &&
+                       (xcr0 & XCR0_AVX) == XCR0_AVX;
+        m_avx512f    = (b & CPUID_7_EBX_AVX512F) &&
+                       (xcr0 & XCR0_AVX512) == XCR0_AVX512;
+        m_clflushopt = b & CPUID_7_EBX_CLFLUSHOPT;
+        m_waitpkg    = c & CPUID_7_ECX_WAITPKG;
+        m_movdir64b  = c & CPUID_7_ECX_MOVDIR64B;
+    }
+
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000001) {
+        __cpuid(0x80000001, a, b, c, d);
+        m_lzcnt = c & CPUID_80000001_ECX_LZCNT;
+    }
+#endif // __x86_64__
+}
+
+inline const cpu_features &cpu_get_features()
+{
+    static const cpu_features features;
+
+    return features;
+}
+
+// resolves a kernel once, usually into a function-local static
+template <typename F>
+inline F cpu_select(bool has_feature, F fast, F portable)
+{
+    return has_feature ? fast : portable;
+}
+
+// leading zeros of a 64 bit value, 64 for 0. a single lzcnt when built for
+// a CPU that has it, bsr and a branch otherwise; both are cheaper than an
+// indirect call, so this one is not dispatched at run time
+inline int cpu_clz64(uint64_t x)
+{
+    return x == 0 ? 64 : __builtin_clzll(x);
+}
+
+#endif // CPU_FEATURES_HPP
@@ -0,0 +1,90 @@
+#ifndef HYBRID_LOCK_HPP
+#define HYBRID_LOCK_HPP
+
+#include "pause.hpp"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define HYBRID_LOCK_SPIN        10   // backoff rounds before sleeping
+#define HYBRID_LOCK_BACKOFF_MAX 1024 // pauses per round, doubling from 1
+
+class hybrid_lock_ac;
+
+// spin-then-park mutex after Drepper's "Futexes Are Tricky"
+//
+// m_state is 0 when free, 1 when held and 2 when held with possible
+// sleepers. A waiter spins with exponential backoff for a bounded time and
+// then sleeps on the futex, so a descheduled holder no longer makes every
+// waiter burn its timeslice. Release wakes a single sleeper, and only when
+// somebody went to sleep.
+class hybrid_lock {
+public:
+    typedef hybrid_lock_ac guard;
+
+    hybrid_lock() : m_state(0) { }
+    ~hybrid_lock() { }
+
+    void lock();
+    void unlock();
+
+private:
+    int m_state;
+
+    bool try_lock();
+};
+
+inline bool hybrid_lock::try_lock()
+{
+    int free = 0;
+
+    return __atomic_compare_exchange_n(&m_state, &free, 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+inline void hybrid_lock::lock()
+{
+    if (try_lock())
+        return;
+
+    uint32_t backoff = 1;
+
+    for (int i = 0; i < HYBRID_LOCK_SPIN; i++) {
+        for (uint32_t j = 0; j < backoff; j++)
+            _MM_PAUSE(); // busy-wait
+
+        if (__atomic_load_n(&m_state, __ATOMIC_RELAXED) == 0 && try_lock())
+            return;
+
+        if (backoff < HYBRID_LOCK_BACKOFF_MAX)
+            backoff <<= 1;
+    }
+
+    // from now on the lock is taken as contended so the holder wakes us,
+    // even if that may cost one needless wake-up once we are the last
+    while (__atomic_exchange_n(&m_state, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &m_state, FUTEX_WAIT_PRIVATE, 2,
+                nullptr, nullptr, 0);
+    }
+}
+
+inline void hybrid_lock::unlock()
+{
+    if (__atomic_exchange_n(&m_state, 0, __ATOMIC_RELEASE) == 2) {
+        syscall(SYS_futex, &m_state, FUTEX_WAKE_PRIVATE, 1,
+                nullptr, nullptr, 0);
+    }
+}
+
+class hybrid_lock_ac {
+public:
+    hybrid_lock_ac(hybrid_lock &lock) : m_hybrid_lock(lock) { lock.lock(); }
+    ~hybrid_lock_ac() { m_hybrid_lock.unlock(); }
+
+private:
+    hybrid_lock &m_hybrid_lock;
+};
+
+#endif // HYBRID_LOCK_HPP
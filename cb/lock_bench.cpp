@@ -0,0 +1,315 @@
+#include "spin_lock.hpp"
+#include "rtm_lock.hpp"
+#include "ticket_lock.hpp"
+#include "mcs_lock.hpp"
+#include "clh_lock.hpp"
+#include "cohort_lock.hpp"
+#include "hybrid_lock.hpp"
+#include "rtm_rw_lock.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// contention benchmark for the locks
+//
+// Every thread repeatedly takes the lock, updates a few shared cache lines
+// inside the critical section and does some private work outside of it.
+// Throughput is reported together with the spread of per-thread counts,
+// which shows how fair a lock is under contention. Reader-writer locks run
+// a mix of reads, which check that all shared lines agree, and writes,
+// which bump every line.
+
+#define BENCH_SHARED_LINES 4
+
+struct config {
+    config() : m_threads(std::thread::hardware_concurrency()), m_seconds(2),
+               m_inside(1), m_outside(100), m_reads(90) { }
+
+    std::vector<std::string> m_locks;
+    int              m_threads;
+    int              m_seconds;
+    int              m_inside;  // shared lines written per critical section
+    int              m_outside; // pauses between critical sections
+    int              m_reads;   // percentage of reads for rw locks
+    std::vector<int> m_cpus;
+};
+
+struct alignas(64) shared_line {
+    uint64_t m_val;
+};
+
+struct alignas(64) thread_count {
+    uint64_t m_ops;
+};
+
+static void
+pin(const config &cfg, int idx)
+{
+    if (cfg.m_cpus.empty())
+        return;
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cfg.m_cpus[idx % cfg.m_cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+template <typename L>
+static bool
+run(const config &cfg, const std::string &name)
+{
+    L lock;
+    shared_line shared[BENCH_SHARED_LINES] = { };
+    std::vector<thread_count> counts(cfg.m_threads);
+    volatile bool stop = false;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < cfg.m_threads; i++) {
+        threads.emplace_back([&, i] {
+            pin(cfg, i);
+
+            uint64_t ops = 0;
+
+            while (! stop) {
+                {
+                    typename L::guard guard(lock);
+
+                    for (int j = 0; j < cfg.m_inside; j++)
+                        shared[j % BENCH_SHARED_LINES].m_val++;
+                }
+
+                for (int j = 0; j < cfg.m_outside; j++)
+                    _MM_PAUSE();
+
+                ops++;
+            }
+
+            counts[i].m_ops = ops;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.m_seconds));
+    stop = true;
+
+    for (auto &t : threads)
+        t.join();
+
+    uint64_t total = 0;
+    uint64_t min   = UINT64_MAX;
+    uint64_t max   = 0;
+
+    for (auto &c : counts) {
+        total += c.m_ops;
+        min    = std::min(min, c.m_ops);
+        max    = std::max(max, c.m_ops);
+    }
+
+    // every critical section bumps the first line once
+    bool ok = shared[0].m_val ==
+              total * ((cfg.m_inside + BENCH_SHARED_LINES - 1) /
+                       BENCH_SHARED_LINES);
+
+    std::cout << "lock = " << name
+              << ", threads = " << cfg.m_threads
+              << ", ops/s = " << (uint64_t)(total / cfg.m_seconds)
+              << ", min/thread = " << min
+              << ", max/thread = " << max
+              << (ok ? "" : ", MUTUAL EXCLUSION VIOLATED")
+              << std::endl;
+
+    return ok;
+}
+
+// reader-writer mix, a torn read means a reader overlapped a writer
+template <typename L>
+static bool
+run_rw(const config &cfg, const std::string &name)
+{
+    L lock;
+    shared_line shared[BENCH_SHARED_LINES] = { };
+    std::vector<thread_count> counts(cfg.m_threads);
+    std::vector<thread_count> writes(cfg.m_threads);
+    volatile bool stop = false;
+    volatile bool torn = false;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < cfg.m_threads; i++) {
+        threads.emplace_back([&, i] {
+            pin(cfg, i);
+
+            uint64_t ops = 0;
+            uint64_t wr  = 0;
+
+            while (! stop) {
+                if ((int)((ops + i) % 100) < cfg.m_reads) {
+                    typename L::read_guard guard(lock);
+
+                    uint64_t v = shared[0].m_val;
+
+                    for (int j = 1; j < BENCH_SHARED_LINES; j++) {
+                        if (shared[j].m_val != v)
+                            torn = true;
+                    }
+                } else {
+                    typename L::guard guard(lock);
+
+                    for (int j = 0; j < BENCH_SHARED_LINES; j++)
+                        shared[j].m_val++;
+
+                    wr++;
+                }
+
+                for (int j = 0; j < cfg.m_outside; j++)
+                    _MM_PAUSE();
+
+                ops++;
+            }
+
+            counts[i].m_ops = ops;
+            writes[i].m_ops = wr;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.m_seconds));
+    stop = true;
+
+    for (auto &t : threads)
+        t.join();
+
+    uint64_t total = 0;
+    uint64_t wr    = 0;
+    uint64_t min   = UINT64_MAX;
+    uint64_t max   = 0;
+
+    for (int i = 0; i < cfg.m_threads; i++) {
+        total += counts[i].m_ops;
+        wr    += writes[i].m_ops;
+        min    = std::min(min, counts[i].m_ops);
+        max    = std::max(max, counts[i].m_ops);
+    }
+
+    bool ok = ! torn && shared[0].m_val == wr;
+
+    std::cout << "lock = " << name
+              << ", threads = " << cfg.m_threads
+              << ", reads = " << cfg.m_reads << "%"
+              << ", ops/s = " << (uint64_t)(total / cfg.m_seconds)
+              << ", min/thread = " << min
+              << ", max/thread = " << max
+              << (ok ? "" : ", MUTUAL EXCLUSION VIOLATED")
+              << std::endl;
+
+    return ok;
+}
+
+static bool
+run_lock(const config &cfg, const std::string &name)
+{
+    if (name == "spin")
+        return run<spin_lock>(cfg, name);
+    else if (name == "rtm")
+        return run<rtm_lock>(cfg, name);
+    else if (name == "ticket")
+        return run<ticket_lock>(cfg, name);
+    else if (name == "mcs")
+        return run<mcs_lock>(cfg, name);
+    else if (name == "clh")
+        return run<clh_lock>(cfg, name);
+    else if (name == "cohort")
+        return run<cohort_lock>(cfg, name);
+    else if (name == "hybrid")
+        return run<hybrid_lock>(cfg, name);
+    else if (name == "rtm_rw")
+        return run_rw<rtm_rw_lock>(cfg, name);
+
+    std::cerr << "unknown lock " << name << std::endl;
+
+    return false;
+}
+
+static void
+usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [options] [lock ...]\n"
+              << "  lock          spin, rtm, ticket, mcs, clh, cohort, hybrid"
+                 " or rtm_rw\n"
+                 "                (default: all)\n"
+              << "  -t num        threads (default: number of CPUs)\n"
+              << "  -d seconds    duration per lock (default: 2)\n"
+              << "  -i lines      shared lines written inside the lock"
+                 " (default: 1)\n"
+              << "  -o pauses     pauses outside the lock (default: 100)\n"
+              << "  -r percent    reads for reader-writer locks"
+                 " (default: 90)\n"
+              << "  -a cpu,...    pin the threads to the CPUs"
+              << std::endl;
+}
+
+int
+main(int argc, char *argv[])
+{
+    config cfg;
+    int    opt;
+
+    while ((opt = getopt(argc, argv, "t:d:i:o:r:a:h")) != -1) {
+        switch (opt) {
+        case 't':
+            cfg.m_threads = atoi(optarg);
+            break;
+        case 'd':
+            cfg.m_seconds = atoi(optarg);
+            break;
+        case 'i':
+            cfg.m_inside = atoi(optarg);
+            break;
+        case 'o':
+            cfg.m_outside = atoi(optarg);
+            break;
+        case 'r':
+            cfg.m_reads = atoi(optarg);
+            break;
+        case 'a': {
+            std::stringstream ss(optarg);
+            std::string cpu;
+
+            while (std::getline(ss, cpu, ','))
+                cfg.m_cpus.push_back(atoi(cpu.c_str()));
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cfg.m_threads < 1 || cfg.m_seconds < 1 || cfg.m_inside < 1 ||
+        cfg.m_reads < 0 || cfg.m_reads > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+        cfg.m_locks.push_back(argv[i]);
+
+    if (cfg.m_locks.empty())
+        cfg.m_locks = { "spin", "rtm", "ticket", "mcs", "clh", "cohort",
+                       "hybrid", "rtm_rw" };
+
+    bool ok = true;
+
+    for (auto &name : cfg.m_locks)
+        ok = run_lock(cfg, name) && ok;
+
+    return ok ? 0 : 1;
+}
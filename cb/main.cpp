@@ -1,56 +1,433 @@
 #include "cb.hpp"
 #include "cb_ms.hpp"
 #include "cb_ms_spin.hpp"
+#include "cb_mpsc.hpp"
+#include "cb_mpmc.hpp"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
-cb_ms_spin<uint64_t> q(4096);
-//cb_ms<uint64_t> q(1024 * 1024);
-//cb<uint64_t> q(1024 * 1024);
+// benchmark for the cb queues
+//
+// Producers stamp every message with the TSC and consumers record the
+// enqueue-to-dequeue latency in a log-linear histogram. The run ends after
+// a fixed duration or a fixed number of messages, after which every
+// consumer gets one message with a zero stamp to stop it.
 
-uint64_t val = 0;
+struct config {
+    config() : m_queue("cb_spsc"), m_wait("busy"), m_len(4096),
+               m_producers(1), m_consumers(1), m_size(8),
+               m_seconds(5), m_ops(0), m_json(false) { }
 
-void
-producer()
+    std::string m_queue;
+    std::string m_wait;
+    size_t      m_len;
+    int         m_producers;
+    int         m_consumers;
+    int         m_size;
+    int         m_seconds;
+    uint64_t    m_ops;     // 0 to run for m_seconds
+    bool        m_json;
+    std::vector<int> m_cpus;
+};
+
+template <size_t SIZE>
+struct msg {
+    uint64_t m_tsc;
+    char     m_pad[SIZE - sizeof(uint64_t)];
+};
+
+template <>
+struct msg<8> {
+    uint64_t m_tsc;
+};
+
+// latency histogram with 16 linear buckets per power of two
+class histogram {
+public:
+    histogram() : m_count(0) { memset(m_bucket, 0, sizeof(m_bucket)); }
+
+    void add(uint64_t v)
+    {
+        m_bucket[index(v)]++;
+        m_count++;
+    }
+
+    void merge(const histogram &h)
+    {
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            m_bucket[i] += h.m_bucket[i];
+        m_count += h.m_count;
+    }
+
+    uint64_t count() const { return m_count; }
+
+    // lower bound of the bucket holding the p-th percentile
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(m_count * p / 100.0);
+        uint64_t n = 0;
+
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            n += m_bucket[i];
+            if (n > rank)
+                return value(i);
+        }
+
+        return 0;
+    }
+
+private:
+    static const int HIST_SUB     = 16;
+    static const int HIST_BUCKETS = 64 * HIST_SUB;
+
+    uint64_t m_bucket[HIST_BUCKETS];
+    uint64_t m_count;
+
+    static int index(uint64_t v)
+    {
+        if (v < HIST_SUB)
+            return v;
+
+        int msb = 63 - __builtin_clzll(v);
+
+        return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+    }
+
+    static uint64_t value(int i)
+    {
+        if (i < HIST_SUB)
+            return i;
+
+        int msb = i / HIST_SUB + 3;
+
+        return (uint64_t)(HIST_SUB + i % HIST_SUB) << (msb - 4);
+    }
+};
+
+struct result {
+    double    m_seconds;
+    histogram m_hist;
+};
+
+// x86intrin.h would clash with the RTM intrinsics of rtm.h
+static inline uint64_t
+rdtsc()
+{
+    return __builtin_ia32_rdtsc();
+}
+
+static double
+tsc_per_ns()
+{
+    auto     t0 = std::chrono::steady_clock::now();
+    uint64_t c0 = rdtsc();
+
+    usleep(100 * 1000);
+
+    auto     t1 = std::chrono::steady_clock::now();
+    uint64_t c1 = rdtsc();
+
+    return (c1 - c0) /
+           (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               t1 - t0).count();
+}
+
+static void
+pin(const config &cfg, int idx)
 {
-    uint64_t n = 0;
+    if (cfg.m_cpus.empty())
+        return;
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cfg.m_cpus[idx % cfg.m_cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+template <typename Q, typename M>
+static void
+run(const config &cfg, result &res)
+{
+    Q q(cfg.m_len);
+
+    volatile bool stop    = false;
+    volatile bool go      = false;
+    int           ready   = 0;
+    int           nthread = cfg.m_producers + cfg.m_consumers;
+
+    std::vector<std::thread> producers, consumers;
+    std::vector<histogram>   hists(cfg.m_consumers);
+
+    auto wait_go = [&] {
+        __sync_fetch_and_add(&ready, 1);
+        while (! go);
+    };
+
+    for (int i = 0; i < cfg.m_producers; i++) {
+        producers.push_back(std::thread([&, i] {
+            uint64_t n = cfg.m_ops / cfg.m_producers;
+            M m;
+
+            if (cfg.m_ops && i < (int)(cfg.m_ops % cfg.m_producers))
+                n++;
 
-    for (;;) {
-        q.push(n++);
+            pin(cfg, i);
+            memset(&m, 0, sizeof(m));
+            wait_go();
+
+            for (uint64_t j = 0; cfg.m_ops ? j < n : ! stop; j++) {
+                m.m_tsc = rdtsc();
+                q.push(m);
+            }
+        }));
     }
+
+    for (int i = 0; i < cfg.m_consumers; i++) {
+        consumers.push_back(std::thread([&, i] {
+            histogram &hist = hists[i];
+
+            pin(cfg, cfg.m_producers + i);
+            wait_go();
+
+            for (;;) {
+                M m = q.pop();
+
+                if (m.m_tsc == 0)
+                    break;
+
+                hist.add(rdtsc() - m.m_tsc);
+            }
+        }));
+    }
+
+    while (__sync_fetch_and_add(&ready, 0) != nthread);
+
+    auto t0 = std::chrono::steady_clock::now();
+
+    go = true;
+
+    if (cfg.m_ops == 0) {
+        std::this_thread::sleep_for(std::chrono::seconds(cfg.m_seconds));
+        stop = true;
+    }
+
+    for (auto &th: producers)
+        th.join();
+
+    M poison;
+
+    memset(&poison, 0, sizeof(poison));
+
+    for (int i = 0; i < cfg.m_consumers; i++)
+        q.push(poison);
+
+    for (auto &th: consumers)
+        th.join();
+
+    auto t1 = std::chrono::steady_clock::now();
+
+    res.m_seconds = std::chrono::duration<double>(t1 - t0).count();
+
+    for (auto &h: hists)
+        res.m_hist.merge(h);
+}
+
+template <typename M, typename W>
+static bool
+run_queue(const config &cfg, result &res)
+{
+    bool single_writer = cfg.m_producers == 1;
+    bool single_reader = cfg.m_consumers == 1;
+
+    if (cfg.m_queue == "cb" && single_writer && single_reader)
+        run<cb<M, W>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_pow2" && single_writer && single_reader)
+        run<cb<M, W, cb_index_pow2>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_spsc" && single_writer && single_reader)
+        run<cb_spsc<M, W>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_spsc_pow2" && single_writer && single_reader)
+        run<cb_spsc<M, W, cb_index_pow2>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_ms" && single_reader)
+        run<cb_ms<M, W>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_ms_spin" && single_reader)
+        run<cb_ms_spin<M, W>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_mpsc" && single_reader)
+        run<cb_mpsc<M, W>, M>(cfg, res);
+    else if (cfg.m_queue == "cb_mpmc")
+        run<cb_mpmc<M, W>, M>(cfg, res);
+    else
+        return false;
+
+    return true;
 }
 
-void
-consumer()
+template <typename W>
+static bool
+run_size(const config &cfg, result &res)
 {
-    for (;;) {
-        val = q.pop();
+    switch (cfg.m_size) {
+    case 8:
+        return run_queue<msg<8>, W>(cfg, res);
+    case 64:
+        return run_queue<msg<64>, W>(cfg, res);
+    case 256:
+        return run_queue<msg<256>, W>(cfg, res);
+    case 1024:
+        return run_queue<msg<1024>, W>(cfg, res);
+    case 4096:
+        return run_queue<msg<4096>, W>(cfg, res);
+    default:
+        return false;
     }
 }
 
+static bool
+run_wait(const config &cfg, result &res)
+{
+    if (cfg.m_wait == "busy")
+        return run_size<cb_wait_busy>(cfg, res);
+    else if (cfg.m_wait == "pause")
+        return run_size<cb_wait_pause>(cfg, res);
+    else if (cfg.m_wait == "backoff")
+        return run_size<cb_wait_backoff>(cfg, res);
+    else if (cfg.m_wait == "futex")
+        return run_size<cb_wait_futex>(cfg, res);
+    else if (cfg.m_wait == "umwait")
+        return run_size<cb_wait_umwait>(cfg, res);
+
+    return false;
+}
+
+static void
+usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  -q queue      cb, cb_pow2, cb_spsc, cb_spsc_pow2, cb_ms,\n"
+              << "                cb_ms_spin, cb_mpsc or cb_mpmc"
+                 " (default: cb_spsc)\n"
+              << "  -w wait       busy, pause, backoff, futex or umwait"
+                 " (default: busy)\n"
+              << "  -l len        capacity (default: 4096)\n"
+              << "  -p num        producers (default: 1)\n"
+              << "  -c num        consumers (default: 1)\n"
+              << "  -s bytes      element size, 8, 64, 256, 1024 or 4096"
+                 " (default: 8)\n"
+              << "  -t seconds    duration (default: 5)\n"
+              << "  -n ops        number of messages instead of a duration\n"
+              << "  -a cpu,...    pin producers then consumers to the CPUs\n"
+              << "  -j            print the result as JSON"
+              << std::endl;
+}
+
 int
 main(int argc, char *argv[])
 {
-    std::thread th0(producer), th1(consumer);
-//    std::thread th2(producer), th3(producer);
+    config cfg;
+    int    opt;
 
-    std::cout << "has RTM?: ";
+    while ((opt = getopt(argc, argv, "q:w:l:p:c:s:t:n:a:jh")) != -1) {
+        switch (opt) {
+        case 'q':
+            cfg.m_queue = optarg;
+            break;
+        case 'w':
+            cfg.m_wait = optarg;
+            break;
+        case 'l':
+            cfg.m_len = strtoull(optarg, nullptr, 0);
+            break;
+        case 'p':
+            cfg.m_producers = atoi(optarg);
+            break;
+        case 'c':
+            cfg.m_consumers = atoi(optarg);
+            break;
+        case 's':
+            cfg.m_size = atoi(optarg);
+            break;
+        case 't':
+            cfg.m_seconds = atoi(optarg);
+            break;
+        case 'n':
+            cfg.m_ops = strtoull(optarg, nullptr, 0);
+            break;
+        case 'a': {
+            std::stringstream ss(optarg);
+            std::string cpu;
 
-    if (cpu_has_rtm())
-        std::cout << "yes" << std::endl;
-    else
-        std::cout << "no" << std::endl;
-
-    uint64_t v = val;
-    for (;;) {
-        std::cout << "val = " << val
-                  << " (" << (val - v) / 5 << " ops/s)"
-                  << "\nlen = " << q.get_len() << std::endl;
-        v = val;
-        sleep(5);
+            while (std::getline(ss, cpu, ','))
+                cfg.m_cpus.push_back(atoi(cpu.c_str()));
+            break;
+        }
+        case 'j':
+            cfg.m_json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cfg.m_producers < 1 || cfg.m_consumers < 1 || cfg.m_len < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    double tsc   = tsc_per_ns();
+    result res;
+
+    if (! run_wait(cfg, res)) {
+        std::cerr << "unsupported combination of queue, wait strategy,"
+                     " element size and thread counts" << std::endl;
+        return 1;
+    }
+
+    uint64_t ops  = res.m_hist.count();
+    double   p50  = res.m_hist.percentile(50) / tsc;
+    double   p99  = res.m_hist.percentile(99) / tsc;
+    double   p999 = res.m_hist.percentile(99.9) / tsc;
+
+    if (cfg.m_json) {
+        std::cout << "{\"queue\": \"" << cfg.m_queue << "\""
+                  << ", \"wait\": \"" << cfg.m_wait << "\""
+                  << ", \"len\": " << cfg.m_len
+                  << ", \"producers\": " << cfg.m_producers
+                  << ", \"consumers\": " << cfg.m_consumers
+                  << ", \"size\": " << cfg.m_size
+                  << ", \"rtm\": " << (cpu_has_rtm() ? "true" : "false")
+                  << ", \"ops\": " << ops
+                  << ", \"seconds\": " << res.m_seconds
+                  << ", \"ops_per_sec\": " << ops / res.m_seconds
+                  << ", \"p50_ns\": " << p50
+                  << ", \"p99_ns\": " << p99
+                  << ", \"p999_ns\": " << p999
+                  << "}" << std::endl;
+    } else {
+        std::cout << "queue = " << cfg.m_queue
+                  << ", wait = " << cfg.m_wait
+                  << ", len = " << cfg.m_len
+                  << ", producers = " << cfg.m_producers
+                  << ", consumers = " << cfg.m_consumers
+                  << ", size = " << cfg.m_size
+                  << "\nhas RTM?: " << (cpu_has_rtm() ? "yes" : "no")
+                  << "\nops = " << ops << " in " << res.m_seconds << " s"
+                  << " (" << (uint64_t)(ops / res.m_seconds) << " ops/s)"
+                  << "\nlatency p50 = " << p50 << " ns"
+                  << ", p99 = " << p99 << " ns"
+                  << ", p99.9 = " << p999 << " ns" << std::endl;
     }
 
     return 0;
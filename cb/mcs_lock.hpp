@@ -0,0 +1,75 @@
+#ifndef MCS_LOCK_HPP
+#define MCS_LOCK_HPP
+
+#include "pause.hpp"
+
+class mcs_lock_ac;
+
+// queue lock by Mellor-Crummey and Scott. waiters form a linked list of
+// nodes kept in their guards and each one spins on its own node, so a
+// release touches only the cache line of the next waiter.
+class mcs_lock {
+public:
+    typedef mcs_lock_ac guard;
+
+    mcs_lock() : m_tail(nullptr) { }
+    ~mcs_lock() { }
+
+private:
+    struct alignas(64) node {
+        node *m_next;
+        int   m_locked;
+    };
+
+    node *m_tail;
+
+    friend class mcs_lock_ac;
+};
+
+class mcs_lock_ac {
+public:
+    mcs_lock_ac(mcs_lock &lock) : m_mcs_lock(lock)
+    {
+        m_node.m_next   = nullptr;
+        m_node.m_locked = 1;
+
+        mcs_lock::node *pred = __atomic_exchange_n(&lock.m_tail, &m_node,
+                                                   __ATOMIC_ACQ_REL);
+
+        if (pred == nullptr)
+            return;
+
+        __atomic_store_n(&pred->m_next, &m_node, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&m_node.m_locked, __ATOMIC_ACQUIRE))
+            _MM_PAUSE(); // busy-wait
+    }
+
+    ~mcs_lock_ac()
+    {
+        mcs_lock::node *next = __atomic_load_n(&m_node.m_next,
+                                               __ATOMIC_ACQUIRE);
+
+        if (next == nullptr) {
+            mcs_lock::node *self = &m_node;
+
+            if (__atomic_compare_exchange_n(&m_mcs_lock.m_tail, &self,
+                                            nullptr, false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+                return;
+
+            // a waiter swapped m_tail but has not linked itself yet
+            while ((next = __atomic_load_n(&m_node.m_next,
+                                           __ATOMIC_ACQUIRE)) == nullptr)
+                _MM_PAUSE(); // busy-wait
+        }
+
+        __atomic_store_n(&next->m_locked, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    mcs_lock       &m_mcs_lock;
+    mcs_lock::node  m_node;
+};
+
+#endif // MCS_LOCK_HPP
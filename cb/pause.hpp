@@ -0,0 +1,11 @@
+#ifndef PAUSE_HPP
+#define PAUSE_HPP
+
+#if defined(__x86_64__) || defined(__i686__)
+    #include <xmmintrin.h>
+    #define _MM_PAUSE _mm_pause
+#else
+    #define _MM_PAUSE()
+#endif // __x86_64__ || __i686__
+
+#endif // PAUSE_HPP
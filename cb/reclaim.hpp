@@ -0,0 +1,430 @@
+#ifndef RECLAIM_HPP
+#define RECLAIM_HPP
+
+#include "cb_common.hpp"
+#include "pause.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+// safe memory reclamation for lock-free structures
+//
+// A node unlinked from a shared structure may still be read by threads
+// which loaded a pointer to it before. Instead of deleting it, the thread
+// which unlinked it calls retire() and the node is deleted once no reader
+// can hold it any more. Two schemes share one interface so a container can
+// take either as a template parameter R:
+//
+//     typename R::guard g(reclaim);           // around every access
+//     node *n = g.protect(0, &head);          // load a shared pointer
+//     ...
+//     reclaim.retire(n);                      // after unlinking n
+//
+// ebr is epoch-based: a guard costs two stores and a fence, but a thread
+// stalled inside a guard holds back every retired node. hazard_ptr
+// publishes each protected pointer, which costs a fence per load, and
+// bounds the unreclaimed nodes whatever the readers do.
+//
+// Threads get one of RECLAIM_MAX_THREADS records per domain, keyed by a
+// process-wide id which is reused after the thread exits. Retired nodes
+// are freed in batches of RECLAIM_BATCH per thread.
+
+#ifndef RECLAIM_MAX_THREADS
+#define RECLAIM_MAX_THREADS 128
+#endif // RECLAIM_MAX_THREADS
+
+#define RECLAIM_BATCH       64   // retired nodes per thread between scans
+#define RECLAIM_EBR_MAX     4096 // retired nodes per thread before waiting
+#define RECLAIM_HAZARDS     4    // hazard pointers per guard
+#define RECLAIM_NEST_MAX    2    // nested hazard_ptr guards per thread
+#define RECLAIM_MARK_MASK   3    // low pointer bits used as marks
+
+// small id of the calling thread in [0, RECLAIM_MAX_THREADS)
+class reclaim_tid {
+public:
+    reclaim_tid();
+    ~reclaim_tid();
+
+    static int get()
+    {
+        static thread_local reclaim_tid tid;
+        return tid.m_id;
+    }
+
+private:
+    static uint64_t *used()
+    {
+        static uint64_t bits[(RECLAIM_MAX_THREADS + 63) / 64];
+        return bits;
+    }
+
+    int m_id;
+};
+
+inline reclaim_tid::reclaim_tid() : m_id(-1)
+{
+    uint64_t *bits = used();
+
+    for (int i = 0; i < RECLAIM_MAX_THREADS; i++) {
+        uint64_t mask = 1ULL << (i % 64);
+
+        if (! (__atomic_fetch_or(&bits[i / 64], mask, __ATOMIC_ACQ_REL) &
+               mask)) {
+            m_id = i;
+            return;
+        }
+    }
+
+    // more live threads than records
+    abort();
+}
+
+inline reclaim_tid::~reclaim_tid()
+{
+    __atomic_fetch_and(&used()[m_id / 64], ~(1ULL << (m_id % 64)),
+                       __ATOMIC_RELEASE);
+}
+
+struct reclaim_node {
+    void  *m_ptr;
+    void (*m_del)(void *);
+    uint64_t m_epoch; // ebr only
+};
+
+template <typename T>
+inline void reclaim_delete(void *p)
+{
+    delete static_cast<T *>(p);
+}
+
+// epoch-based reclamation after Fraser
+//
+// A guard announces the global epoch it runs in. The epoch advances once
+// every thread inside a guard has seen the current one, and nodes retired
+// in epoch e are freed when the global epoch reaches e + 2. A thread with
+// RECLAIM_EBR_MAX nodes pending waits for the epoch to move on, so the
+// memory held back is bounded, at the cost of blocking behind a stalled
+// reader.
+class ebr {
+public:
+    class guard {
+    public:
+        guard(ebr &domain);
+        ~guard();
+
+        template <typename T>
+        T *protect(int, T *const *src)
+        {
+            return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+        }
+
+    private:
+        ebr &m_ebr;
+    };
+
+    ebr() : m_epoch(2) { }
+    ~ebr();
+
+    template <typename T>
+    void retire(T *p) { retire(p, reclaim_delete<T>); }
+    void retire(void *p, void (*del)(void *));
+
+    // about the number of retired nodes a thread frees at once
+    static size_t batch() { return RECLAIM_BATCH; }
+
+private:
+    static const uint64_t ACTIVE = 1;
+
+    struct alignas(CB_CACHE_LINE_SIZE) record {
+        record() : m_local(0), m_nest(0) { }
+
+        uint64_t m_local; // announced epoch << 1 | ACTIVE, 0 when idle
+        uint32_t m_nest;
+        std::vector<reclaim_node> m_retired;
+    };
+
+    alignas(CB_CACHE_LINE_SIZE) uint64_t m_epoch;
+    record m_rec[RECLAIM_MAX_THREADS];
+
+    bool try_advance();
+    void collect(record &rec);
+    void drain(record &rec);
+};
+
+inline ebr::guard::guard(ebr &domain) : m_ebr(domain)
+{
+    ebr::record &rec = domain.m_rec[reclaim_tid::get()];
+
+    if (rec.m_nest++ > 0) {
+        return;
+    }
+
+    uint64_t epoch = __atomic_load_n(&domain.m_epoch, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&rec.m_local, epoch << 1 | ACTIVE, __ATOMIC_RELAXED);
+
+    // the announcement must be visible before any shared load
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+inline ebr::guard::~guard()
+{
+    ebr::record &rec = m_ebr.m_rec[reclaim_tid::get()];
+
+    if (--rec.m_nest > 0) {
+        return;
+    }
+
+    __atomic_store_n(&rec.m_local, 0, __ATOMIC_RELEASE);
+
+    // retire() cannot wait for the backlog inside a guard, do it now
+    if (rec.m_retired.size() >= RECLAIM_EBR_MAX) {
+        m_ebr.drain(rec);
+    }
+}
+
+inline ebr::~ebr()
+{
+    for (int i = 0; i < RECLAIM_MAX_THREADS; i++) {
+        for (auto &n : m_rec[i].m_retired) {
+            n.m_del(n.m_ptr);
+        }
+    }
+}
+
+inline bool ebr::try_advance()
+{
+    uint64_t epoch = __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < RECLAIM_MAX_THREADS; i++) {
+        uint64_t local = __atomic_load_n(&m_rec[i].m_local, __ATOMIC_ACQUIRE);
+
+        if ((local & ACTIVE) && (local >> 1) != epoch) {
+            return false;
+        }
+    }
+
+    __atomic_compare_exchange_n(&m_epoch, &epoch, epoch + 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+inline void ebr::collect(record &rec)
+{
+    uint64_t epoch = __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+    size_t   kept  = 0;
+
+    for (auto &n : rec.m_retired) {
+        if (n.m_epoch + 2 <= epoch) {
+            n.m_del(n.m_ptr);
+        } else {
+            rec.m_retired[kept++] = n;
+        }
+    }
+
+    rec.m_retired.resize(kept);
+}
+
+inline void ebr::retire(void *p, void (*del)(void *))
+{
+    record &rec = m_rec[reclaim_tid::get()];
+
+    rec.m_retired.push_back(reclaim_node{
+        p, del, __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE)});
+
+    if (rec.m_retired.size() % RECLAIM_BATCH != 0) {
+        return;
+    }
+
+    try_advance();
+    collect(rec);
+
+    // our own guard would hold the epoch back, the guard drains on exit
+    if (rec.m_retired.size() >= RECLAIM_EBR_MAX && rec.m_nest == 0) {
+        drain(rec);
+    }
+}
+
+// wait until the backlog is below RECLAIM_EBR_MAX, outside of any guard
+inline void ebr::drain(record &rec)
+{
+    for (;;) {
+        collect(rec);
+
+        if (rec.m_retired.size() < RECLAIM_EBR_MAX) {
+            return;
+        }
+
+        if (! try_advance()) {
+            _MM_PAUSE(); // busy-wait
+        }
+    }
+}
+
+// hazard pointers after Michael
+//
+// protect() publishes the pointer in one of RECLAIM_HAZARDS slots of the
+// guard and re-reads the source until it is stable, the guard clears the
+// slots on exit. Each of up to RECLAIM_NEST_MAX nested guards of a thread
+// has its own slots, so an inner guard cannot unprotect the pointers of an
+// outer one; nesting deeper aborts. A thread scans all hazards once it has
+// retired max(RECLAIM_BATCH, 2 * HAZARDS * RECLAIM_MAX_THREADS) nodes and
+// frees those not found, so the unreclaimed nodes per thread stay below
+// that. Marks in the low RECLAIM_MARK_MASK bits are ignored.
+class hazard_ptr {
+public:
+    class guard {
+    public:
+        guard(hazard_ptr &domain);
+        ~guard();
+
+        template <typename T>
+        T *protect(int idx, T *const *src);
+
+    private:
+        hazard_ptr &m_hazard_ptr;
+        uintptr_t  *m_slot;
+    };
+
+    hazard_ptr() { }
+    ~hazard_ptr();
+
+    template <typename T>
+    void retire(T *p) { retire(p, reclaim_delete<T>); }
+    void retire(void *p, void (*del)(void *));
+
+    // the most retired nodes a thread frees at once
+    static size_t batch() { return SCAN; }
+
+private:
+    static const int    HAZARDS = RECLAIM_HAZARDS * RECLAIM_NEST_MAX;
+    static const size_t SCAN = 2 * HAZARDS * RECLAIM_MAX_THREADS >
+                               RECLAIM_BATCH ?
+                               2 * HAZARDS * RECLAIM_MAX_THREADS :
+                               RECLAIM_BATCH;
+
+    struct alignas(CB_CACHE_LINE_SIZE) record {
+        record() : m_nest(0)
+        {
+            std::fill(m_hazard, m_hazard + HAZARDS, 0);
+        }
+
+        uintptr_t m_hazard[HAZARDS]; // RECLAIM_HAZARDS per nesting level
+        uint32_t  m_nest;
+        std::vector<reclaim_node> m_retired;
+        std::vector<uintptr_t>    m_scan; // kept so a scan does not allocate
+    };
+
+    record m_rec[RECLAIM_MAX_THREADS];
+
+    void scan(record &rec);
+};
+
+inline hazard_ptr::guard::guard(hazard_ptr &domain)
+    : m_hazard_ptr(domain)
+{
+    hazard_ptr::record &rec = domain.m_rec[reclaim_tid::get()];
+
+    if (rec.m_nest >= RECLAIM_NEST_MAX) {
+        abort();
+    }
+
+    m_slot = rec.m_hazard + rec.m_nest++ * RECLAIM_HAZARDS;
+}
+
+inline hazard_ptr::guard::~guard()
+{
+    hazard_ptr::record &rec = m_hazard_ptr.m_rec[reclaim_tid::get()];
+
+    for (int i = 0; i < RECLAIM_HAZARDS; i++) {
+        __atomic_store_n(&m_slot[i], 0, __ATOMIC_RELEASE);
+    }
+
+    rec.m_nest--;
+}
+
+template <typename T>
+inline T *hazard_ptr::guard::protect(int idx, T *const *src)
+{
+    T *p = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        __atomic_store_n(&m_slot[idx], (uintptr_t)p, __ATOMIC_RELAXED);
+
+        // the hazard must be visible before the source is checked again
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        T *q = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+
+        if (q == p) {
+            return p;
+        }
+
+        p = q;
+    }
+}
+
+inline hazard_ptr::~hazard_ptr()
+{
+    for (int i = 0; i < RECLAIM_MAX_THREADS; i++) {
+        for (auto &n : m_rec[i].m_retired) {
+            n.m_del(n.m_ptr);
+        }
+    }
+}
+
+inline void hazard_ptr::scan(record &rec)
+{
+    std::vector<uintptr_t> &hazards = rec.m_scan;
+
+    hazards.clear();
+    hazards.reserve(HAZARDS * RECLAIM_MAX_THREADS);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < RECLAIM_MAX_THREADS; i++) {
+        for (int j = 0; j < HAZARDS; j++) {
+            uintptr_t h = __atomic_load_n(&m_rec[i].m_hazard[j],
+                                          __ATOMIC_ACQUIRE);
+
+            if (h != 0) {
+                hazards.push_back(h & ~(uintptr_t)RECLAIM_MARK_MASK);
+            }
+        }
+    }
+
+    std::sort(hazards.begin(), hazards.end());
+
+    size_t kept = 0;
+
+    for (auto &n : rec.m_retired) {
+        if (std::binary_search(hazards.begin(), hazards.end(),
+                               (uintptr_t)n.m_ptr)) {
+            rec.m_retired[kept++] = n;
+        } else {
+            n.m_del(n.m_ptr);
+        }
+    }
+
+    rec.m_retired.resize(kept);
+}
+
+inline void hazard_ptr::retire(void *p, void (*del)(void *))
+{
+    record &rec = m_rec[reclaim_tid::get()];
+
+    rec.m_retired.push_back(reclaim_node{p, del, 0});
+
+    if (rec.m_retired.size() >= SCAN) {
+        scan(rec);
+    }
+}
+
+#endif // RECLAIM_HPP
@@ -1,42 +1,61 @@
 #ifndef RTM_LOCK_HPP
 #define RTM_LOCK_HPP
 
-// #define DEBUG_RTM
-
 #ifdef __x86_64__
     #include "rtm.h"
-    #include "tsx-cpuid.h"
 #endif // __x86_64__
 
-#if defined(__x86_64__) || defined(__i686__)
-    #include <xmmintrin.h>
-    #define _MM_PAUSE _mm_pause
-#else
-    #define _MM_PAUSE
-#endif // __x86_64__ || __i686__
+#include "cpu_features.hpp"
+#include "pause.hpp"
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 
 #define RTM_MAX_RETRY 6
 
-#ifdef DEBUG_RTM
-    #include <iostream>
-#endif // DEBUG_RTM
+// statistics are kept per thread in one of RTM_STAT_SLOTS slots of the
+// lock, a cache line of counters each, so 1 KiB per lock by default.
+// threads beyond that share slots and may lose some counts.
+#ifndef RTM_STAT_SLOTS
+#define RTM_STAT_SLOTS 16
+#endif // RTM_STAT_SLOTS
+
+// elision of a lock is suspended after RTM_ADAPT_FAILS fallbacks in a row,
+// counted over all its threads. the number of acquisitions it stays
+// suspended starts at RTM_ADAPT_SKIP_MIN and doubles up to
+// RTM_ADAPT_SKIP_MAX while probing keeps failing, then resets once a
+// transaction commits.
+#define RTM_ADAPT_FAILS    4
+#define RTM_ADAPT_SKIP_MIN 16
+#define RTM_ADAPT_SKIP_MAX 4096
 
 class rtm_transaction;
 
+struct rtm_stats {
+    rtm_stats() { memset(this, 0, sizeof(*this)); }
+
+    uint64_t m_commit;   // critical sections run as a transaction
+    uint64_t m_fallback; // critical sections run under the real lock
+    uint64_t m_skip;     // fallbacks without trying because of the policy
+
+    // every abort counts in exactly one of these by its first cause bit,
+    // so they add up to the number of aborts
+    uint64_t m_conflict; // _XABORT_CONFLICT
+    uint64_t m_capacity; // _XABORT_CAPACITY
+    uint64_t m_explicit; // _xabort(), e.g. the lock was held
+    uint64_t m_other;    // no cause bit, e.g. interrupts
+
+    uint64_t m_retry;    // aborts of any cause with _XABORT_RETRY set
+};
+
 class rtm_lock {
 public:
+    typedef rtm_transaction guard;
 
 #ifdef __x86_64__
-#ifdef DEBUG_RTM
-    rtm_lock(bool is_rtm) : m_is_rtm(is_rtm),
-                            m_lock(0), m_nlock(0), m_nrtm(0) { }
-    rtm_lock() : m_is_rtm(cpu_has_rtm()), m_lock(0), m_nlock(0), m_nrtm(0) { }
-#else
     rtm_lock(bool is_rtm) : m_is_rtm(is_rtm), m_lock(0) { }
-    rtm_lock() : m_is_rtm(cpu_has_rtm()), m_lock(0) { }
-#endif // DEBUG_RTM
+    rtm_lock() : m_is_rtm(cpu_get_features().m_rtm), m_lock(0) { }
 #else
     rtm_lock(bool is_rtm) : m_lock(0) { }
     rtm_lock() : m_lock(0) { }
@@ -44,26 +63,96 @@ public:
 
     ~rtm_lock() { }
 
+    // sum of the per-thread counters. may be called at any time, counts
+    // of critical sections running concurrently may or may not be included
+    rtm_stats get_stats() const;
+    void      reset_stats();
+
 private:
+    // the policy of the lock, on a line of its own so that updating it
+    // does not abort the transactions which read m_lock. only written
+    // under m_lock, except for the reset after a commit
+    struct alignas(64) adapt {
+        adapt() : m_fail_run(0), m_skip(0),
+                  m_skip_next(RTM_ADAPT_SKIP_MIN) { }
+
+        uint32_t m_fail_run;  // fallbacks in a row
+        uint32_t m_skip;      // acquisitions left without elision
+        uint32_t m_skip_next; // m_skip for the next suspension
+    };
+
+    struct alignas(64) stat_slot {
+        rtm_stats m_stats;
+    };
+
 #ifdef __x86_64__
     bool m_is_rtm;
 #endif // __x86_64__
 
     volatile int m_lock;
-#ifdef DEBUG_RTM
-    volatile int m_nlock;
-    volatile int m_nrtm;
-#endif // DEBUG_RTM
+
+    adapt     m_adapt;
+    stat_slot m_slot[RTM_STAT_SLOTS];
+
+    rtm_stats &get_slot();
 
     friend class rtm_transaction;
 };
 
+inline rtm_stats &rtm_lock::get_slot()
+{
+    static uint32_t next_id = 0;
+    static thread_local uint32_t id = __sync_fetch_and_add(&next_id, 1);
+
+    return m_slot[id % RTM_STAT_SLOTS].m_stats;
+}
+
+inline rtm_stats rtm_lock::get_stats() const
+{
+    rtm_stats sum;
+
+    for (int i = 0; i < RTM_STAT_SLOTS; i++) {
+        const rtm_stats &s = m_slot[i].m_stats;
+
+        sum.m_commit   += __atomic_load_n(&s.m_commit, __ATOMIC_RELAXED);
+        sum.m_fallback += __atomic_load_n(&s.m_fallback, __ATOMIC_RELAXED);
+        sum.m_skip     += __atomic_load_n(&s.m_skip, __ATOMIC_RELAXED);
+        sum.m_conflict += __atomic_load_n(&s.m_conflict, __ATOMIC_RELAXED);
+        sum.m_capacity += __atomic_load_n(&s.m_capacity, __ATOMIC_RELAXED);
+        sum.m_explicit += __atomic_load_n(&s.m_explicit, __ATOMIC_RELAXED);
+        sum.m_retry    += __atomic_load_n(&s.m_retry, __ATOMIC_RELAXED);
+        sum.m_other    += __atomic_load_n(&s.m_other, __ATOMIC_RELAXED);
+    }
+
+    return sum;
+}
+
+inline void rtm_lock::reset_stats()
+{
+    for (int i = 0; i < RTM_STAT_SLOTS; i++) {
+        m_slot[i].m_stats = rtm_stats();
+    }
+}
+
+// owner-only increment, visible to get_stats() without a locked instruction
+#define RTM_STAT_INC(x) \
+    __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + 1, \
+                     __ATOMIC_RELAXED)
+
 class rtm_transaction {
 public:
-    rtm_transaction(rtm_lock &lock) : m_rtm_lock(lock)
+    rtm_transaction(rtm_lock &lock)
+        : m_rtm_lock(lock), m_stats(lock.get_slot())
     {
 #ifdef __x86_64__
-        if (lock.m_is_rtm) {
+        rtm_lock::adapt &a = lock.m_adapt;
+        bool skipped = false;
+        bool failed  = false;
+
+        if (lock.m_is_rtm && __atomic_load_n(&a.m_skip, __ATOMIC_RELAXED)) {
+            skipped = true;
+            RTM_STAT_INC(m_stats.m_skip);
+        } else if (lock.m_is_rtm) {
             unsigned status;
             int i;
 
@@ -76,16 +165,22 @@ public:
                     _xabort(0xff);
                 }
 
+                count_abort(status);
+
                 if ((status & _XABORT_EXPLICIT) &&
                     _XABORT_CODE(status) == 0xff &&
                     ! (status & _XABORT_NESTED)) {
 
                     while (lock.m_lock)
                         _MM_PAUSE(); // busy-wait
-                } else if (!(status & _XABORT_RETRY)) {
+                } else if ((status & _XABORT_CAPACITY) ||
+                           ! (status & _XABORT_RETRY)) {
+                    // retrying cannot help
                     break;
                 }
             }
+
+            failed = true;
         }
 #endif // __x86_64__
 
@@ -93,37 +188,79 @@ public:
             while (lock.m_lock)
                 _MM_PAUSE(); // busy-wait
         }
+
+#ifdef __x86_64__
+        // the holder of the lock owns the policy
+        if (skipped && a.m_skip > 0) {
+            __atomic_store_n(&a.m_skip, a.m_skip - 1, __ATOMIC_RELAXED);
+        } else if (failed && ++a.m_fail_run >= RTM_ADAPT_FAILS) {
+            suspend();
+        }
+#endif // __x86_64__
     }
 
     ~rtm_transaction()
     {
 #ifdef __x86_64__
         if (m_rtm_lock.m_lock) {
-#ifdef DEBUG_RTM
-            m_rtm_lock.m_nlock++;
-#endif // DEBUG_RTM
             __sync_lock_release(&m_rtm_lock.m_lock);
+            RTM_STAT_INC(m_stats.m_fallback);
         } else {
-#ifdef DEBUG_RTM
-            m_rtm_lock.m_nrtm++;
-#endif // DEBUG_RTM
             _xend();
+            RTM_STAT_INC(m_stats.m_commit);
+
+            rtm_lock::adapt &a = m_rtm_lock.m_adapt;
+
+            // only write the shared line when there is something to reset.
+            // racing with the holder of the lock only blurs the heuristic
+            if (__atomic_load_n(&a.m_fail_run, __ATOMIC_RELAXED) != 0 ||
+                __atomic_load_n(&a.m_skip_next, __ATOMIC_RELAXED) !=
+                    RTM_ADAPT_SKIP_MIN) {
+                __atomic_store_n(&a.m_fail_run, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&a.m_skip_next, RTM_ADAPT_SKIP_MIN,
+                                 __ATOMIC_RELAXED);
+            }
         }
 #else
         __sync_lock_release(&m_rtm_lock.m_lock);
+        RTM_STAT_INC(m_stats.m_fallback);
 #endif // __x86_64__
-
-#if defined(__x86_64__) && defined(DEBUG_RTM)
-        if (((m_rtm_lock.m_nlock + m_rtm_lock.m_nrtm) % 10000000) == 0) {
-            std::cout << "m_nlock = " << m_rtm_lock.m_nlock
-                      << ", m_nrtm = " << m_rtm_lock.m_nrtm
-                      << std::endl;
-        }
-#endif // DEBUG_RTM
     }
 
 private:
-    rtm_lock &m_rtm_lock;
+    rtm_lock  &m_rtm_lock;
+    rtm_stats &m_stats;
+
+#ifdef __x86_64__
+    void count_abort(unsigned status)
+    {
+        if (status & _XABORT_CONFLICT)
+            RTM_STAT_INC(m_stats.m_conflict);
+        else if (status & _XABORT_CAPACITY)
+            RTM_STAT_INC(m_stats.m_capacity);
+        else if (status & _XABORT_EXPLICIT)
+            RTM_STAT_INC(m_stats.m_explicit);
+        else
+            RTM_STAT_INC(m_stats.m_other);
+
+        if (status & _XABORT_RETRY)
+            RTM_STAT_INC(m_stats.m_retry);
+    }
+
+    // stop eliding the lock for a while, backing off further while probes
+    // fail. called under the lock
+    void suspend()
+    {
+        rtm_lock::adapt &a = m_rtm_lock.m_adapt;
+
+        __atomic_store_n(&a.m_skip, a.m_skip_next, __ATOMIC_RELAXED);
+        a.m_fail_run = 0;
+
+        if (a.m_skip_next < RTM_ADAPT_SKIP_MAX)
+            __atomic_store_n(&a.m_skip_next, a.m_skip_next << 1,
+                             __ATOMIC_RELAXED);
+    }
+#endif // __x86_64__
 };
 
 #endif // RTM_LOCK_HPP
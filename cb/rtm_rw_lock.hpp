@@ -0,0 +1,166 @@
+#ifndef RTM_RW_LOCK_HPP
+#define RTM_RW_LOCK_HPP
+
+#ifdef __x86_64__
+    #include "rtm.h"
+#endif // __x86_64__
+
+#include "cpu_features.hpp"
+#include "pause.hpp"
+
+#include <stdint.h>
+
+#define RTM_RW_MAX_RETRY 6
+
+// reader counters, one per cache line. threads beyond that share counters,
+// which is still correct but makes readers contend again.
+#ifndef RTM_RW_SLOTS
+#define RTM_RW_SLOTS 64
+#endif // RTM_RW_SLOTS
+
+class rtm_rw_read_ac;
+class rtm_rw_write_ac;
+
+// reader-writer lock for read-mostly data
+//
+// Readers first try to run as a transaction that only reads m_writer, so
+// they share no cache line with each other and a writer taking the lock
+// aborts them. Without RTM, or once elision keeps failing, a reader
+// announces itself in a per-thread counter (a distributed reader
+// indicator) and checks m_writer afterwards. A writer sets m_writer and
+// then waits for every counter to drain. Writers are preferred: readers
+// back off while m_writer is set.
+class rtm_rw_lock {
+public:
+    typedef rtm_rw_write_ac guard;
+    typedef rtm_rw_read_ac  read_guard;
+
+#ifdef __x86_64__
+    rtm_rw_lock(bool is_rtm) : m_is_rtm(is_rtm), m_writer(0) { }
+    rtm_rw_lock() : m_is_rtm(cpu_get_features().m_rtm), m_writer(0) { }
+#else
+    rtm_rw_lock(bool is_rtm) : m_writer(0) { }
+    rtm_rw_lock() : m_writer(0) { }
+#endif // __x86_64__
+
+    ~rtm_rw_lock() { }
+
+private:
+    struct alignas(64) slot {
+        slot() : m_readers(0) { }
+
+        uint32_t m_readers;
+    };
+
+#ifdef __x86_64__
+    bool m_is_rtm;
+#endif // __x86_64__
+
+    alignas(64) int m_writer;
+
+    slot m_slot[RTM_RW_SLOTS];
+
+    slot &get_slot();
+
+    friend class rtm_rw_read_ac;
+    friend class rtm_rw_write_ac;
+};
+
+inline rtm_rw_lock::slot &rtm_rw_lock::get_slot()
+{
+    static uint32_t next_id = 0;
+    static thread_local uint32_t id = __sync_fetch_and_add(&next_id, 1);
+
+    return m_slot[id % RTM_RW_SLOTS];
+}
+
+class rtm_rw_read_ac {
+public:
+    rtm_rw_read_ac(rtm_rw_lock &lock) : m_rtm_rw_lock(lock), m_slot(nullptr)
+    {
+#ifdef __x86_64__
+        if (lock.m_is_rtm) {
+            for (int i = 0; i < RTM_RW_MAX_RETRY; i++) {
+                unsigned status = _xbegin();
+                if (status == _XBEGIN_STARTED) {
+                    if (! __atomic_load_n(&lock.m_writer, __ATOMIC_RELAXED)) {
+                        return;
+                    }
+                    _xabort(0xff);
+                }
+
+                if ((status & _XABORT_EXPLICIT) &&
+                    _XABORT_CODE(status) == 0xff &&
+                    ! (status & _XABORT_NESTED)) {
+
+                    while (__atomic_load_n(&lock.m_writer, __ATOMIC_RELAXED))
+                        _MM_PAUSE(); // busy-wait
+                } else if ((status & _XABORT_CAPACITY) ||
+                           ! (status & _XABORT_RETRY)) {
+                    // retrying cannot help
+                    break;
+                }
+            }
+        }
+#endif // __x86_64__
+
+        m_slot = &lock.get_slot();
+
+        for (;;) {
+            // seq_cst pairs with the writer: either it sees our count or
+            // we see its m_writer
+            __atomic_fetch_add(&m_slot->m_readers, 1, __ATOMIC_SEQ_CST);
+
+            if (! __atomic_load_n(&lock.m_writer, __ATOMIC_SEQ_CST))
+                return;
+
+            __atomic_fetch_sub(&m_slot->m_readers, 1, __ATOMIC_RELEASE);
+
+            while (__atomic_load_n(&lock.m_writer, __ATOMIC_RELAXED))
+                _MM_PAUSE(); // busy-wait
+        }
+    }
+
+    ~rtm_rw_read_ac()
+    {
+        if (m_slot == nullptr) {
+#ifdef __x86_64__
+            _xend();
+#endif // __x86_64__
+        } else {
+            __atomic_fetch_sub(&m_slot->m_readers, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+private:
+    rtm_rw_lock       &m_rtm_rw_lock;
+    rtm_rw_lock::slot *m_slot; // nullptr while elided
+};
+
+class rtm_rw_write_ac {
+public:
+    rtm_rw_write_ac(rtm_rw_lock &lock) : m_rtm_rw_lock(lock)
+    {
+        // the store to m_writer aborts every elided reader
+        while (__atomic_exchange_n(&lock.m_writer, 1, __ATOMIC_SEQ_CST)) {
+            while (__atomic_load_n(&lock.m_writer, __ATOMIC_RELAXED))
+                _MM_PAUSE(); // busy-wait
+        }
+
+        for (int i = 0; i < RTM_RW_SLOTS; i++) {
+            while (__atomic_load_n(&lock.m_slot[i].m_readers,
+                                   __ATOMIC_ACQUIRE))
+                _MM_PAUSE(); // busy-wait
+        }
+    }
+
+    ~rtm_rw_write_ac()
+    {
+        __atomic_store_n(&m_rtm_rw_lock.m_writer, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    rtm_rw_lock &m_rtm_rw_lock;
+};
+
+#endif // RTM_RW_LOCK_HPP
@@ -5,6 +5,8 @@ class spin_lock_ac;
 
 class spin_lock {
 public:
+    typedef spin_lock_ac guard;
+
     spin_lock() : m_lock(0) { }
     ~spin_lock() { }
 
@@ -0,0 +1,65 @@
+#ifndef TICKET_LOCK_HPP
+#define TICKET_LOCK_HPP
+
+#include "pause.hpp"
+
+#include <stdint.h>
+
+// pauses per waiter ahead of us between two checks of m_serving
+#define TICKET_LOCK_BACKOFF 64
+
+class ticket_lock_ac;
+
+// FIFO spin lock. a waiter takes a ticket and waits until it is served,
+// backing off in proportion to the number of waiters ahead of it. the lock
+// may be released by another thread than the one which acquired it.
+class ticket_lock {
+public:
+    typedef ticket_lock_ac guard;
+
+    ticket_lock() : m_next(0), m_serving(0) { }
+    ~ticket_lock() { }
+
+    void lock();
+    void unlock();
+
+    // true if somebody is waiting behind the holder
+    bool has_waiters();
+
+private:
+    alignas(64) uint32_t m_next;
+    alignas(64) uint32_t m_serving;
+};
+
+inline void ticket_lock::lock()
+{
+    uint32_t ticket = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+    uint32_t serving;
+
+    while ((serving = __atomic_load_n(&m_serving, __ATOMIC_ACQUIRE)) !=
+           ticket) {
+        for (uint32_t i = 0; i < (ticket - serving) * TICKET_LOCK_BACKOFF; i++)
+            _MM_PAUSE(); // busy-wait
+    }
+}
+
+inline void ticket_lock::unlock()
+{
+    __atomic_store_n(&m_serving, m_serving + 1, __ATOMIC_RELEASE);
+}
+
+inline bool ticket_lock::has_waiters()
+{
+    return __atomic_load_n(&m_next, __ATOMIC_RELAXED) - m_serving > 1;
+}
+
+class ticket_lock_ac {
+public:
+    ticket_lock_ac(ticket_lock &lock) : m_ticket_lock(lock) { lock.lock(); }
+    ~ticket_lock_ac() { m_ticket_lock.unlock(); }
+
+private:
+    ticket_lock &m_ticket_lock;
+};
+
+#endif // TICKET_LOCK_HPP
@@ -0,0 +1,391 @@
+#ifndef CSL_HPP
+#define CSL_HPP
+
+#include "sl.hpp"
+#include "../cb/reclaim.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+template <typename K, typename V, int MAX_LEVEL> class csl;
+
+template <typename K, typename V, int MAX_LEVEL>
+class csl_node {
+public:
+    static csl_node *create(const K &key, V *val, int level);
+    static void      destroy(void *p);
+
+private:
+    csl_node(const K &key, V *val, int level)
+        : m_key(key), m_val(val), m_level(level), m_refs(2) { }
+    ~csl_node() { delete m_val; }
+
+    K        m_key;
+    V       *m_val;
+    uint8_t  m_level;
+    uint8_t  m_refs;       // inserter and deleter, the last one retires
+    csl_node *m_forward[1]; // m_level entries, low bit marks deletion
+
+    friend class csl<K, V, MAX_LEVEL>;
+};
+
+// lock-free concurrent skip list with the interface of sl
+//
+// Nodes are linked bottom-up with CAS. erase() marks the forward pointers
+// of a node top-down, the thread whose mark on level 0 succeeds owns the
+// deletion, and any later search which passes the node snips it out
+// (Fraser, Herlihy-Shavit). find() never writes and skips marked nodes, so
+// it never retries, but it is only lock-free: inserts arriving ahead of it
+// can keep lengthening its walk. Unlinked nodes and replaced values are
+// freed through the epoch-based reclamation of cb/reclaim.hpp; hazard
+// pointers do not fit since find() walks through nodes which are already
+// unlinked.
+//
+// find() either copies the value out or returns a pointer to it, which
+// takes the caller's guard and stays valid while the guard is held, e.g.
+// { csl<K, V>::guard g(list); const V *v = list.find(g, k); }.
+// insert() of an existing key replaces the value.
+template <typename K, typename V, int MAX_LEVEL = 32>
+class csl {
+public:
+    class guard : public ebr::guard {
+    public:
+        guard(csl &list) : ebr::guard(list.m_reclaim) { }
+    };
+
+    csl();
+    virtual ~csl();
+
+    void insert(const K &key, const V &val);
+    void erase(const K &key);
+    bool find(const K &key, V &val);
+    const V* find(guard &g, const K &key);
+
+private:
+    typedef csl_node<K, V, MAX_LEVEL> node;
+
+    static bool  is_marked(node *p) { return (uintptr_t)p & 1; }
+    static node *marked(node *p) { return (node *)((uintptr_t)p | 1); }
+    static node *unmarked(node *p) { return (node *)((uintptr_t)p & ~1UL); }
+
+    node *m_header;
+    int   m_level; // highest level in use, only grows
+
+    // destroyed first, it may still free retired nodes
+    ebr m_reclaim;
+
+    int   random_level();
+    bool  search(const K &key, node **preds, node **succs);
+    node *lookup(const K &key);
+    void  release(node *n);
+};
+
+template <typename K, typename V, int MAX_LEVEL>
+inline csl_node<K, V, MAX_LEVEL> *
+csl_node<K, V, MAX_LEVEL>::create(const K &key, V *val, int level)
+{
+    void *p = ::operator new(sizeof(csl_node) +
+                             (level - 1) * sizeof(csl_node *));
+
+    return new (p) csl_node(key, val, level);
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline void csl_node<K, V, MAX_LEVEL>::destroy(void *p)
+{
+    csl_node *n = static_cast<csl_node *>(p);
+
+    n->~csl_node();
+    ::operator delete(p);
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline csl<K, V, MAX_LEVEL>::csl() : m_level(1)
+{
+    m_header = node::create(K(), nullptr, MAX_LEVEL);
+
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        m_header->m_forward[i] = nullptr;
+    }
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline csl<K, V, MAX_LEVEL>::~csl()
+{
+    node *p = m_header;
+
+    while (p != nullptr) {
+        node *p1 = unmarked(p->m_forward[0]);
+        node::destroy(p);
+        p = p1;
+    }
+}
+
+// geometric level from a per-thread generator, nothing shared
+template <typename K, typename V, int MAX_LEVEL>
+inline int csl<K, V, MAX_LEVEL>::random_level()
+{
+    static thread_local xorshift xs;
+    static thread_local bool     seeded = false;
+
+    if (! seeded) {
+        xs.init_xor128((uint32_t)(uintptr_t)&xs);
+        seeded = true;
+    }
+
+    int lvl = 1;
+
+    while (lvl < MAX_LEVEL && xs.xor128() < (UINT32_MAX / 2))
+        lvl++;
+
+    return lvl;
+}
+
+// fill the predecessors and successors of key on every level, snipping
+// marked nodes on the way. true if an unmarked node with key is found
+template <typename K, typename V, int MAX_LEVEL>
+inline bool csl<K, V, MAX_LEVEL>::search(const K &key, node **preds,
+                                         node **succs)
+{
+retry:
+    node *pred = m_header;
+    int   top  = __atomic_load_n(&m_level, __ATOMIC_RELAXED);
+
+    for (int i = MAX_LEVEL - 1; i >= top; i--) {
+        preds[i] = m_header;
+        succs[i] = unmarked(__atomic_load_n(&m_header->m_forward[i],
+                                            __ATOMIC_ACQUIRE));
+    }
+
+    for (int i = top - 1; i >= 0; i--) {
+        node *curr = unmarked(__atomic_load_n(&pred->m_forward[i],
+                                              __ATOMIC_ACQUIRE));
+
+        for (;;) {
+            if (curr == nullptr)
+                break;
+
+            node *succ = __atomic_load_n(&curr->m_forward[i],
+                                         __ATOMIC_ACQUIRE);
+
+            if (is_marked(succ)) {
+                node *expected = curr;
+
+                if (! __atomic_compare_exchange_n(&pred->m_forward[i],
+                                                  &expected, unmarked(succ),
+                                                  false, __ATOMIC_ACQ_REL,
+                                                  __ATOMIC_RELAXED))
+                    goto retry;
+
+                curr = unmarked(succ);
+                continue;
+            }
+
+            if (! (curr->m_key < key))
+                break;
+
+            pred = curr;
+            curr = succ;
+        }
+
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+
+    return succs[0] != nullptr && succs[0]->m_key == key;
+}
+
+// drop one of the two references, the last one retires the node
+template <typename K, typename V, int MAX_LEVEL>
+inline void csl<K, V, MAX_LEVEL>::release(node *n)
+{
+    if (__atomic_sub_fetch(&n->m_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        m_reclaim.retire(n, node::destroy);
+    }
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline void csl<K, V, MAX_LEVEL>::insert(const K &key, const V &val)
+{
+    node *preds[MAX_LEVEL];
+    node *succs[MAX_LEVEL];
+    ebr::guard g(m_reclaim);
+    V    *new_val  = new V(val);
+    int   level    = random_level();
+    node *new_node = nullptr;
+
+    for (;;) {
+        if (search(key, preds, succs)) {
+            if (new_node != nullptr) {
+                new_node->m_val = nullptr;
+                node::destroy(new_node);
+            }
+
+            V *old = __atomic_exchange_n(&succs[0]->m_val, new_val,
+                                         __ATOMIC_ACQ_REL);
+            m_reclaim.retire(old);
+            return;
+        }
+
+        if (new_node == nullptr) {
+            new_node = node::create(key, new_val, level);
+        }
+
+        for (int i = 0; i < level; i++) {
+            new_node->m_forward[i] = succs[i];
+        }
+
+        node *expected = succs[0];
+
+        if (__atomic_compare_exchange_n(&preds[0]->m_forward[0], &expected,
+                                        new_node, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    int top = __atomic_load_n(&m_level, __ATOMIC_RELAXED);
+
+    while (top < level &&
+           ! __atomic_compare_exchange_n(&m_level, &top, level, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    // the node is in the list now, link the upper levels unless it gets
+    // erased meanwhile
+    for (int i = 1; i < level; i++) {
+        for (;;) {
+            node *next = __atomic_load_n(&new_node->m_forward[i],
+                                         __ATOMIC_ACQUIRE);
+
+            if (is_marked(next) ||
+                (next != succs[i] &&
+                 ! __atomic_compare_exchange_n(&new_node->m_forward[i],
+                                               &next, succs[i], false,
+                                               __ATOMIC_RELEASE,
+                                               __ATOMIC_RELAXED)))
+                goto done;
+
+            node *expected = succs[i];
+
+            if (__atomic_compare_exchange_n(&preds[i]->m_forward[i],
+                                            &expected, new_node, false,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+                break;
+
+            if (! search(key, preds, succs) || succs[0] != new_node)
+                goto done;
+        }
+
+        // erased while we linked it, make sure the deleter's search did
+        // not miss this level
+        if (is_marked(__atomic_load_n(&new_node->m_forward[i],
+                                      __ATOMIC_ACQUIRE))) {
+            search(key, preds, succs);
+            goto done;
+        }
+    }
+
+done:
+    release(new_node);
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline void csl<K, V, MAX_LEVEL>::erase(const K &key)
+{
+    node *preds[MAX_LEVEL];
+    node *succs[MAX_LEVEL];
+    ebr::guard g(m_reclaim);
+
+    if (! search(key, preds, succs))
+        return;
+
+    node *victim = succs[0];
+
+    for (int i = victim->m_level - 1; i > 0; i--) {
+        node *next = __atomic_load_n(&victim->m_forward[i], __ATOMIC_ACQUIRE);
+
+        while (! is_marked(next) &&
+               ! __atomic_compare_exchange_n(&victim->m_forward[i], &next,
+                                             marked(next), false,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    node *next = __atomic_load_n(&victim->m_forward[0], __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        if (is_marked(next))
+            return; // another erase won
+
+        if (__atomic_compare_exchange_n(&victim->m_forward[0], &next,
+                                        marked(next), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    // snip the node out of every level
+    search(key, preds, succs);
+
+    release(victim);
+}
+
+// the unmarked node with key or nullptr, read only. the caller holds a
+// guard
+template <typename K, typename V, int MAX_LEVEL>
+inline csl_node<K, V, MAX_LEVEL> *csl<K, V, MAX_LEVEL>::lookup(const K &key)
+{
+    node *pred = m_header;
+    node *curr = nullptr;
+
+    for (int i = __atomic_load_n(&m_level, __ATOMIC_RELAXED) - 1; i >= 0;
+         i--) {
+        curr = unmarked(__atomic_load_n(&pred->m_forward[i],
+                                        __ATOMIC_ACQUIRE));
+
+        while (curr != nullptr) {
+            node *succ = __atomic_load_n(&curr->m_forward[i],
+                                         __ATOMIC_ACQUIRE);
+
+            if (is_marked(succ)) {
+                curr = unmarked(succ);
+            } else if (curr->m_key < key) {
+                pred = curr;
+                curr = succ;
+            } else {
+                break;
+            }
+        }
+    }
+
+    return curr != nullptr && curr->m_key == key ? curr : nullptr;
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline bool csl<K, V, MAX_LEVEL>::find(const K &key, V &val)
+{
+    ebr::guard g(m_reclaim);
+    node *n = lookup(key);
+
+    if (n == nullptr) {
+        return false;
+    }
+
+    val = *__atomic_load_n(&n->m_val, __ATOMIC_ACQUIRE);
+
+    return true;
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline const V* csl<K, V, MAX_LEVEL>::find(guard &, const K &key)
+{
+    node *n = lookup(key);
+
+    return n != nullptr ? __atomic_load_n(&n->m_val, __ATOMIC_ACQUIRE)
+                        : nullptr;
+}
+
+#endif // CSL_HPP
@@ -1,16 +1,89 @@
+#include "csl.hpp"
 #include "sl.hpp"
+#include "sl_pool.hpp"
 
-#include <time.h>
+#include <stdint.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
 
-int
-main(int argc, char *argv[])
+// correctness checks for sl and csl
+//
+// Every test prints its name and ok or the first failed check, and the
+// exit status tells whether all of them passed. Tests run one after the
+// other, all of them unless some are named on the command line. The
+// benchmarks only run when named, e.g. ./main bench_finger.
+
+#define CHECK(c)                                                          \
+    do {                                                                  \
+        if (! (c)) {                                                      \
+            std::cout << "FAILED at line " << __LINE__ << ": " #c         \
+                      << std::endl;                                       \
+            return false;                                                 \
+        }                                                                 \
+    } while (0)
+
+// the list holds exactly the entries of the map, in order both ways
+template <typename K, typename V>
+static bool
+same(sl<K, V> &s, const std::map<K, V> &m)
 {
-    srand(time(NULL));
+    CHECK(s.size() == m.size());
+
+    auto it = s.begin();
+
+    for (auto &kv : m) {
+        CHECK(it != s.end());
+        CHECK(it->first == kv.first && it->second == kv.second);
+        ++it;
+    }
+
+    CHECK(it == s.end());
+
+    auto rit = m.rbegin();
+
+    for (auto jt = s.end(); jt != s.begin();) {
+        --jt;
+        CHECK(rit != m.rend());
+        CHECK(jt->first == rit->first);
+        ++rit;
+    }
+
+    CHECK(rit == m.rend());
+
+    return true;
+}
+
+// counts its live instances, to tell that the list destroys what it holds
+struct counted {
+    counted(int v = 0) : m_v(v) { s_live++; }
+    counted(const counted &c) : m_v(c.m_v) { s_live++; }
+    ~counted() { s_live--; }
 
+    counted &operator=(const counted &c)
+    {
+        m_v = c.m_v;
+        return *this;
+    }
+
+    bool operator==(const counted &c) const { return m_v == c.m_v; }
+
+    int m_v;
+
+    static long s_live;
+};
+
+long counted::s_live;
+
+static bool
+test_basic()
+{
     sl<int, int> s;
-    const int *p;
 
     s.erase(10);
 
@@ -18,27 +91,715 @@ main(int argc, char *argv[])
         s.insert(i, i);
     }
 
-    std::cout << "find(10) = " << *s.find(10) << std::endl;
-    std::cout << "find(20) = " << *s.find(20) << std::endl;
-    std::cout << "find(30) = " << *s.find(30) << std::endl;
-    std::cout << "find(40) = " << *s.find(40) << std::endl;
-    std::cout << "find(50) = " << *s.find(50) << std::endl;
+    for (int i = 10; i <= 50; i += 10) {
+        CHECK(s.find(i) != nullptr && *s.find(i) == i);
+    }
 
     s.erase(10);
-
-    std::cout << "erase(10)" << std::endl;
-
-    if (s.find(10) == nullptr)
-        std::cout << "not find 10" << std::endl;
+    CHECK(s.find(10) == nullptr);
 
     for (int i = 0; i < 10000; i++) {
         s.erase(i);
-        if (s.find(i) != nullptr)
-            std::cout << "ERROR: i = " << i << std::endl;
+        CHECK(s.find(i) == nullptr);
+    }
+
+    CHECK(s.find(255) == nullptr);
+
+    return true;
+}
+
+// threads insert, erase and find a small set of keys at once. a value
+// tells its key, so a find() must never see the value of another key nor
+// a freed one
+static bool
+test_csl_threads()
+{
+    const int      threads = 4;
+    const int      keys    = 64;
+    const int      ops     = 1000000;
+    const uint64_t mul     = 1000000;
+    csl<int, uint64_t> l;
+    bool ok[threads];
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        ok[t] = true;
+        workers.emplace_back([&, t] {
+            xorshift xs;
+
+            xs.init_xor128(t + 1);
+
+            for (int i = 0; i < ops; i++) {
+                uint32_t r = xs.xor128();
+                int      k = r % keys;
+                uint64_t v;
+
+                switch ((r >> 8) % 4) {
+                case 0:
+                    l.insert(k, k * mul + i);
+                    break;
+                case 1:
+                    l.erase(k);
+                    break;
+                case 2:
+                    if (l.find(k, v))
+                        ok[t] = v / mul == (uint64_t)k && ok[t];
+                    break;
+                default: {
+                    csl<int, uint64_t>::guard g(l);
+                    const uint64_t *p = l.find(g, k);
+
+                    if (p != nullptr) {
+                        v = *p;
+                        // a later insert replaces, never frees, the value
+                        // while the guard is held
+                        ok[t] = v / mul == (uint64_t)k && *p == v && ok[t];
+                    }
+                    break;
+                }
+                }
+            }
+        });
+    }
+
+    for (auto &w : workers)
+        w.join();
+
+    for (int t = 0; t < threads; t++)
+        CHECK(ok[t]);
+
+    // disjoint inserts, then disjoint erases of every other key, racing
+    workers.clear();
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (int k = t; k < 4096; k += threads)
+                l.insert(k, k * mul);
+        });
+    }
+
+    for (auto &w : workers)
+        w.join();
+
+    workers.clear();
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (int k = 2 * t; k < 4096; k += 2 * threads)
+                l.erase(k);
+        });
+    }
+
+    for (auto &w : workers)
+        w.join();
+
+    for (int k = 0; k < 4096; k++) {
+        uint64_t v;
+        bool     found = l.find(k, v);
+
+        CHECK(found == (k % 2 == 1));
+        CHECK(! found || v == k * mul);
+    }
+
+    return true;
+}
+
+// freed chunks are reused by their own class, blocks are aligned
+static bool
+test_pool()
+{
+    // sizes are rounded up to the alignment
+    sl_pool pool(24, 8, 4, 16);
+
+    CHECK(pool.get_size(0) == 32 && pool.get_size(3) == 80);
+
+    void *a = pool.alloc(0);
+    void *b = pool.alloc(3);
+
+    CHECK((uintptr_t)a % 16 == 0 && (uintptr_t)b % 16 == 0);
+    CHECK(a != b);
+
+    pool.free(a, 0);
+    CHECK(pool.alloc(1) != a);
+    CHECK(pool.alloc(0) == a);
+
+    // more than a block of chunks
+    std::vector<void *> v;
+
+    for (int i = 0; i < 3 * SL_POOL_BLOCK / 32; i++) {
+        v.push_back(pool.alloc(0));
+        CHECK((uintptr_t)v.back() % 16 == 0);
+    }
+
+    std::sort(v.begin(), v.end());
+    CHECK(std::adjacent_find(v.begin(), v.end()) == v.end());
+
+    pool.clear();
+    CHECK(pool.alloc(2) != nullptr);
+
+    return true;
+}
+
+// random inserts and erases of heap-allocated keys and values, so freed
+// and reused chunks must construct and destroy them properly
+static bool
+test_pool_strings()
+{
+    std::map<std::string, std::string> m;
+    xorshift xs;
+
+    {
+        sl<std::string, std::string> s;
+
+        for (int i = 0; i < 200000; i++) {
+            uint32_t    r = xs.xor128();
+            std::string k = "key-" + std::to_string(r % 5000) +
+                            std::string(r % 40, 'k');
+            std::string v = "value-" + std::to_string(i) +
+                            std::string(r % 50, 'v');
+
+            if (r % 3 == 0) {
+                s.erase(k);
+                m.erase(k);
+            } else {
+                s.insert(k, v);
+                m[k] = v;
+            }
+
+            if (i % 20000 == 0)
+                CHECK(same(s, m));
+        }
+
+        CHECK(same(s, m));
+
+        for (auto &kv : m)
+            CHECK(s.find(kv.first) != nullptr &&
+                  *s.find(kv.first) == kv.second);
+    }
+
+    // a list of non-trivial values destroys all of them, erased or not
+    {
+        sl<int, counted> s;
+
+        for (int i = 0; i < 10000; i++)
+            s.insert(i, counted(i));
+
+        for (int i = 0; i < 10000; i += 3)
+            s.erase(i);
+
+        // and the header
+        CHECK(counted::s_live == (long)s.size() + 1);
+    }
+
+    CHECK(counted::s_live == 0);
+
+    return true;
+}
+
+// iterators in both directions, on an empty list and at the last entry
+static bool
+test_iter()
+{
+    sl<int, int> s;
+    std::map<int, int> m;
+    const sl<int, int> &cs = s;
+
+    CHECK(s.begin() == s.end());
+    CHECK(cs.begin() == cs.end());
+    CHECK(s.lower_bound(0) == s.end() && s.upper_bound(0) == s.end());
+    CHECK(same(s, m));
+
+    s.insert(5, 50);
+    m[5] = 50;
+
+    CHECK(s.begin() != s.end() && s.begin()->first == 5);
+    CHECK(--s.end() == s.begin());
+    CHECK(same(s, m));
+
+    xorshift xs;
+
+    for (int i = 0; i < 5000; i++) {
+        int k = xs.xor128() % 10000;
+
+        s.insert(k, i);
+        m[k] = i;
+    }
+
+    CHECK(same(s, m));
+    CHECK((--s.end())->first == m.rbegin()->first);
+
+    // the last entry goes and comes back, the tail follows
+    int last = m.rbegin()->first;
+
+    s.erase(last);
+    m.erase(last);
+    CHECK((--s.end())->first == m.rbegin()->first);
+    CHECK(same(s, m));
+
+    s.insert(last + 1, 1);
+    m[last + 1] = 1;
+    CHECK((--s.end())->first == last + 1);
+
+    // the first entry too
+    int first = m.begin()->first;
+
+    s.erase(first);
+    m.erase(first);
+    CHECK(s.begin()->first == m.begin()->first);
+    CHECK(same(s, m));
+
+    // postfix forms and writes through an iterator
+    auto it = s.begin();
+    auto jt = it++;
+
+    CHECK(jt == s.begin() && it != jt);
+    CHECK(it-- != s.begin() && it == s.begin());
+
+    for (auto &kv : s)
+        kv.second *= 2;
+
+    for (auto &kv : m)
+        kv.second *= 2;
+
+    CHECK(same(s, m));
+
+    sl<int, int>::const_iterator ci = s.begin();
+
+    CHECK(ci == s.begin() && ci->second == m.begin()->second);
+
+    while (s.size() > 0) {
+        int k = s.begin()->first;
+
+        s.erase(k);
+        m.erase(k);
+    }
+
+    CHECK(s.begin() == s.end());
+    CHECK(same(s, m));
+
+    return true;
+}
+
+// bounds and range scans at, between and beyond the keys
+static bool
+test_bounds()
+{
+    sl<int, int> s;
+    std::map<int, int> m;
+    const sl<int, int> &cs = s;
+    xorshift xs;
+
+    CHECK(s.range(0, 100, [](const int &, int &) { }) == 0);
+
+    for (int i = 0; i < 2000; i++) {
+        int k = 10 * (xs.xor128() % 1000);
+
+        s.insert(k, k + 1);
+        m[k] = k + 1;
+    }
+
+    for (int k = -20; k < 10020; k++) {
+        auto lb = m.lower_bound(k);
+        auto ub = m.upper_bound(k);
+
+        CHECK(lb == m.end() ? s.lower_bound(k) == s.end() :
+                              s.lower_bound(k)->first == lb->first);
+        CHECK(ub == m.end() ? s.upper_bound(k) == s.end() :
+                              s.upper_bound(k)->first == ub->first);
+        CHECK(lb == m.end() ? cs.lower_bound(k) == cs.end() :
+                              cs.lower_bound(k)->first == lb->first);
+        CHECK(ub == m.end() ? cs.upper_bound(k) == cs.end() :
+                              cs.upper_bound(k)->first == ub->first);
     }
 
-    if (s.find(255) == nullptr)
-        std::cout << "not find 255" << std::endl;
+    int lo[] = { -100, 0, 5, 10, 4990, 9990, 10000 };
+    int hi[] = { -50, 0, 10, 11, 5000, 10000, 20000 };
+
+    for (int l : lo) {
+        for (int h : hi) {
+            std::vector<int> keys;
+            size_t n = s.range(l, h, [&](const int &k, int &v) {
+                keys.push_back(k);
+                v++;
+            });
+
+            std::vector<int> want;
+
+            for (auto i = m.lower_bound(l); i != m.end() && i->first < h;
+                 ++i) {
+                want.push_back(i->first);
+                i->second++;
+            }
+
+            CHECK(n == want.size() && keys == want);
+        }
+    }
+
+    // the values written by f
+    CHECK(same(s, m));
+
+    return true;
+}
+
+// the finger is where the last search ended. runs up, down and across
+// the list, with erases moving it and levels coming and going
+static bool
+test_finger()
+{
+    sl<int, int> s;
+    std::map<int, int> m;
+    xorshift xs;
+
+    auto find = [&](int k) -> bool {
+        auto i = m.find(k);
+        const int *v = s.find(k);
+
+        return i == m.end() ? v == nullptr : v != nullptr && *v == i->second;
+    };
+
+    for (int k = 0; k < 3000; k += 3) {
+        s.insert(k, k);
+        m[k] = k;
+        CHECK(find(k) && find(k + 1) && find(k - 3));
+    }
+
+    for (int k = 5999; k > 3000; k -= 2) {
+        s.insert(k, k);
+        m[k] = k;
+        CHECK(find(k) && find(k - 1));
+    }
+
+    int k = 0;
+
+    for (int round = 0; round < 20000; round++) {
+        uint32_t r = xs.xor128();
+
+        // mostly a short step from the last key, sometimes a jump
+        k = r % 8 == 0 ? (int)(r % 7000) - 500 : k + (int)(r % 17) - 5;
+
+        switch ((r >> 4) % 3) {
+        case 0:
+            s.insert(k, round);
+            m[k] = round;
+            break;
+        case 1:
+            s.erase(k);
+            m.erase(k);
+            break;
+        default:
+            break;
+        }
+
+        CHECK(find(k) && find(k + 1) && find(k - 1));
+    }
+
+    CHECK(same(s, m));
+
+    // erase in order, which drops the levels one by one
+    for (int k = -1000; k < 8000; k++) {
+        s.erase(k);
+        m.erase(k);
+        CHECK(find(k + 1));
+    }
+
+    CHECK(s.size() == 0 && same(s, m));
+
+    s.insert(1, 1);
+    m[1] = 1;
+    CHECK(find(0) && find(1) && find(2) && same(s, m));
+
+    return true;
+}
+
+// inserts and finds from a hint, which is right before the key, the key
+// itself, past it, end() or far behind it
+static bool
+test_hint()
+{
+    sl<int, int> s;
+    std::map<int, int> m;
+    xorshift xs;
+
+    // ascending runs from the last insert
+    auto it = s.begin();
+
+    for (int k = 0; k < 20000; k += 2) {
+        it = s.insert(it, k, k);
+        m[k] = k;
+        CHECK(it != s.end() && it->first == k && it->second == k);
+    }
+
+    CHECK(same(s, m));
+
+    for (int round = 0; round < 50000; round++) {
+        uint32_t r = xs.xor128();
+        int      k = r % 22000;
+        auto     h = s.begin();
+
+        switch ((r >> 16) % 5) {
+        case 0:
+            // the predecessor or the key itself
+            h = s.upper_bound(k);
+            if (h != s.begin())
+                --h;
+            break;
+        case 1:
+            // somewhere before
+            h = s.lower_bound(k - (int)(r % 300));
+            break;
+        case 2:
+            // past the key, not a usable hint
+            h = s.upper_bound(k + 10);
+            break;
+        case 3:
+            h = s.end();
+            break;
+        default:
+            break;
+        }
+
+        if ((r >> 8) % 4 == 0) {
+            // erase searches from the finger, which a hint insert may
+            // have made stale
+            s.erase(k);
+            m.erase(k);
+            continue;
+        }
+
+        if ((r >> 8) % 2 == 0) {
+            auto i = m.find(k);
+            const int *v = s.find(h, k);
+
+            CHECK(i == m.end() ? v == nullptr : v != nullptr &&
+                                                *v == i->second);
+            continue;
+        }
+
+        auto x = s.insert(h, k, round);
+
+        m[k] = round;
+        CHECK(x != s.end() && x->first == k && x->second == round);
+
+        const int *v = s.find(k);
+
+        CHECK(v != nullptr && *v == round);
+    }
+
+    CHECK(same(s, m));
+
+    for (auto &kv : m) {
+        const int *v = s.find(kv.first);
+
+        CHECK(v != nullptr && *v == kv.second);
+    }
+
+    return true;
+}
+
+// loads of every small size and some larger ones, with duplicates, into
+// empty and non-empty lists, followed by updates
+static bool
+test_bulk_load()
+{
+    xorshift xs;
+
+    for (int random = 0; random < 2; random++) {
+        sl<int, int> s;
+        std::map<int, int> m;
+
+        // nothing into an empty and into a non-empty list
+        std::vector<std::pair<int, int>> none;
+
+        s.bulk_load(none.begin(), none.end(), random);
+        CHECK(same(s, m));
+
+        s.insert(1, 1);
+        s.bulk_load(none.begin(), none.end(), random);
+        CHECK(same(s, m) && s.find(1) == nullptr);
+
+        int sizes[] = { 1, 2, 3, 7, 8, 9, 1000, 4097 };
+
+        for (int n : sizes) {
+            // sorted with runs of equal keys, of which the last one wins
+            std::vector<std::pair<int, int>> in;
+            int k = -5;
+
+            for (int i = 0; in.size() < (size_t)n; i++) {
+                k += xs.xor128() % 4 == 0 ? 0 : 1 + xs.xor128() % 3;
+                in.push_back(std::make_pair(k, i));
+            }
+
+            m.clear();
+
+            for (auto &kv : in)
+                m[kv.first] = kv.second;
+
+            // over whatever the last round left
+            s.bulk_load(in.begin(), in.end(), random);
+            CHECK(same(s, m));
+
+            for (auto &kv : m)
+                CHECK(s.find(kv.first) != nullptr &&
+                      *s.find(kv.first) == kv.second);
+
+            CHECK(s.find(-10) == nullptr && s.find(k + 1) == nullptr);
+
+            // appends after the load start from the finger at the tail,
+            // the rest mixes inserts and erases through the loaded nodes
+            for (int i = 1; i <= 100; i++) {
+                s.insert(k + i, i);
+                m[k + i] = i;
+            }
+
+            for (int i = 0; i < 2 * n; i++) {
+                uint32_t r  = xs.xor128();
+                int      rk = (int)(r % (k + 120)) - 10;
+
+                if (r % 3 == 0) {
+                    s.erase(rk);
+                    m.erase(rk);
+                } else {
+                    s.insert(rk, i);
+                    m[rk] = i;
+                }
+            }
+
+            CHECK(same(s, m));
+        }
+    }
+
+    // from a map, with keys and values which need their destructors
+    std::map<std::string, std::string> m;
+
+    for (int i = 0; i < 3000; i++)
+        m["key-" + std::to_string(i) + std::string(30, 'k')] =
+            std::string(40, 'v') + std::to_string(i);
+
+    sl<std::string, std::string> s;
+
+    s.insert("old", "old");
+    s.bulk_load(m.begin(), m.end());
+    CHECK(same(s, m));
+    s.bulk_load(m.begin(), m.end(), true);
+    CHECK(same(s, m));
+
+    for (int i = 0; i < 3000; i += 2) {
+        std::string k = "key-" + std::to_string(i) + std::string(30, 'k');
+
+        s.erase(k);
+        m.erase(k);
+    }
+
+    CHECK(same(s, m));
+
+    return true;
+}
+
+static double
+ms_since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - t).count();
+}
+
+// sequential insert and find of 2M ints, which the finger makes O(1)
+// amortized per key
+static bool
+bench_finger()
+{
+    const int n = 2000000;
+    auto      t = std::chrono::steady_clock::now();
+    sl<int, int> s;
+
+    for (int i = 0; i < n; i++)
+        s.insert(i, i);
+
+    for (int i = 0; i < n; i++)
+        CHECK(*s.find(i) == i);
+
+    std::cout << "insert + find of " << n << " ints: " << ms_since(t)
+              << " ms" << std::endl;
+
+    return true;
+}
+
+// 10M sorted ints loaded at once and inserted one by one
+static bool
+bench_bulk_load()
+{
+    const int n = 10000000;
+    std::vector<std::pair<int, int>> in;
+
+    for (int i = 0; i < n; i++)
+        in.push_back(std::make_pair(i, i));
+
+    {
+        auto t = std::chrono::steady_clock::now();
+        sl<int, int> s;
+
+        s.bulk_load(in.begin(), in.end());
+
+        std::cout << "bulk_load of " << n << " ints: " << ms_since(t)
+                  << " ms" << std::endl;
+        CHECK(s.size() == (size_t)n);
+    }
+
+    {
+        auto t = std::chrono::steady_clock::now();
+        sl<int, int> s;
+
+        for (auto &kv : in)
+            s.insert(kv.first, kv.second);
+
+        std::cout << "sequential insert of " << n << " ints: "
+                  << ms_since(t) << " ms" << std::endl;
+        CHECK(s.size() == (size_t)n);
+    }
+
+    return true;
+}
+
+struct test {
+    const char *m_name;
+    bool      (*m_run)();
+    bool        m_bench; // only run when named
+};
+
+static const test tests[] = {
+    { "basic",        test_basic,        false },
+    { "pool",         test_pool,         false },
+    { "pool_strings", test_pool_strings, false },
+    { "iter",         test_iter,         false },
+    { "bounds",       test_bounds,       false },
+    { "finger",       test_finger,       false },
+    { "hint",         test_hint,         false },
+    { "bulk_load",    test_bulk_load,    false },
+    { "csl_threads",  test_csl_threads,  false },
+    { "bench_finger", bench_finger,      true },
+    { "bench_bulk",   bench_bulk_load,   true },
+};
+
+int
+main(int argc, char *argv[])
+{
+    bool ok = true;
+
+    for (const test &t : tests) {
+        bool selected = argc < 2 && ! t.m_bench;
+
+        for (int i = 1; i < argc; i++)
+            selected = selected || t.m_name == std::string(argv[i]);
+
+        if (! selected)
+            continue;
+
+        std::cout << "test = " << t.m_name << std::endl;
+
+        if (t.m_run())
+            std::cout << "ok" << std::endl;
+        else
+            ok = false;
+    }
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -1,8 +1,18 @@
 #ifndef SL_HPP
 #define SL_HPP
 
+#include "sl_pool.hpp"
+#include "../cb/cpu_features.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
 class xorshift {
 public:
     xorshift() : x(123456789), y(362436069), z(521288629), w(88675123) { }
@@ -24,26 +34,111 @@ private:
     uint32_t x, y, z, w;
 };
 
+#define SL_PREFETCH_LEVELS 4 // upper levels prefetched by a range scan
+
 template <typename K, typename V, int MAX_LEVEL> class sl;
+template <typename K, typename V, int MAX_LEVEL, typename T> class sl_iterator;
 
+// a node and its forward array in one chunk of the list's pool. m_forward
+// is declared with one entry but has m_level of them.
 template <typename K, typename V, int MAX_LEVEL>
 class sl_node {
+private:
+    sl_node(const K &key, const V &val, uint8_t level)
+        : m_level(level), m_kv(key, val) { }
+
+    static size_t size(int level)
+    {
+        return sizeof(sl_node) + (level - 1) * sizeof(sl_node *);
+    }
+
+    uint8_t m_level;
+    std::pair<const K, V> m_kv;
+    sl_node *m_backward; // on level 0, nullptr for the first node
+    sl_node *m_forward[1];
+
+    friend class sl<K, V, MAX_LEVEL>;
+    template <typename, typename, int, typename> friend class sl_iterator;
+};
+
+// bidirectional iterator over level 0. T is the value type, possibly const.
+// end() is a null node, decrementing it gives the last node.
+template <typename K, typename V, int MAX_LEVEL, typename T>
+class sl_iterator {
 public:
-    sl_node() { }
-    virtual ~sl_node() { delete[] m_forward; }
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef std::pair<const K, V>           value_type;
+    typedef ptrdiff_t                       difference_type;
+    typedef T                              *pointer;
+    typedef T                              &reference;
+
+    sl_iterator() : m_node(nullptr), m_tail(nullptr) { }
+
+    // iterator to const_iterator
+    template <typename U>
+    sl_iterator(const sl_iterator<K, V, MAX_LEVEL, U> &it)
+        : m_node(it.m_node), m_tail(it.m_tail) { }
+
+    reference operator*() const { return m_node->m_kv; }
+    pointer   operator->() const { return &m_node->m_kv; }
+
+    sl_iterator &operator++()
+    {
+        m_node = m_node->m_forward[0];
+        return *this;
+    }
+
+    sl_iterator &operator--()
+    {
+        m_node = m_node != nullptr ? m_node->m_backward : *m_tail;
+        return *this;
+    }
+
+    sl_iterator operator++(int)
+    {
+        sl_iterator it = *this;
+        ++*this;
+        return it;
+    }
+
+    sl_iterator operator--(int)
+    {
+        sl_iterator it = *this;
+        --*this;
+        return it;
+    }
+
+    template <typename U>
+    bool operator==(const sl_iterator<K, V, MAX_LEVEL, U> &it) const
+    {
+        return m_node == it.m_node;
+    }
+
+    template <typename U>
+    bool operator!=(const sl_iterator<K, V, MAX_LEVEL, U> &it) const
+    {
+        return m_node != it.m_node;
+    }
 
 private:
-    uint8_t m_level;
-    K m_key;
-    V m_val;
-    sl_node **m_forward;
+    typedef sl_node<K, V, MAX_LEVEL> node;
+
+    sl_iterator(node *n, node *const *tail) : m_node(n), m_tail(tail) { }
+
+    node        *m_node;
+    node *const *m_tail; // the list's m_tail
 
     friend class sl<K, V, MAX_LEVEL>;
+    template <typename, typename, int, typename> friend class sl_iterator;
 };
 
 template <typename K, typename V, int MAX_LEVEL = 32>
 class sl {
 public:
+    typedef sl_iterator<K, V, MAX_LEVEL, std::pair<const K, V>> iterator;
+    typedef sl_iterator<K, V, MAX_LEVEL, const std::pair<const K, V>>
+        const_iterator;
+
     sl();
     virtual ~sl();
 
@@ -51,38 +146,127 @@ public:
     void erase(const K &key);
     const V* find(const K &key);
 
+    // search forward from hint, an entry with a key not greater than key
+    // such as the one returned by the last insert. cheaper than a search
+    // from the head when the hint is near, otherwise the same as without
+    iterator insert(const_iterator hint, const K &key, const V &val);
+    const V* find(const_iterator hint, const K &key);
+
+    iterator       begin() { return make_iter(m_header->m_forward[0]); }
+    iterator       end() { return make_iter(nullptr); }
+    const_iterator begin() const { return make_iter(m_header->m_forward[0]); }
+    const_iterator end() const { return make_iter(nullptr); }
+
+    // first entry with a key not less than, resp. greater than key
+    iterator       lower_bound(const K &key);
+    iterator       upper_bound(const K &key);
+    const_iterator lower_bound(const K &key) const;
+    const_iterator upper_bound(const K &key) const;
+
+    // call f(key, val) for every entry with lo <= key < hi in order and
+    // return their number. nodes ahead are prefetched through the upper
+    // levels of the current one.
+    template <typename F>
+    size_t range(const K &lo, const K &hi, F f);
+
+    // replace the contents with the entries of [first, last), which must be
+    // sorted by key, of equal keys the last one wins. the levels are built
+    // bottom-up in one pass and all nodes are carved from one allocation,
+    // sized by a first pass, so It must be a forward iterator. levels are
+    // 1 + the trailing zeros of the position, a perfectly balanced list, or
+    // drawn as by insert() if random is true.
+    template <typename It>
+    void bulk_load(It first, It last, bool random = false);
+
+    size_t size() const { return m_size; }
+
 private:
-    sl_node<K, V, MAX_LEVEL> *m_header;
+    typedef sl_node<K, V, MAX_LEVEL> node;
+
+    // nodes of level l come from class l - 1
+    sl_pool  m_pool;
+    node    *m_header;
+    node    *m_tail; // last node on level 0, nullptr if empty
     uint64_t m_size;
     uint8_t  m_level;
 
+    // predecessors of the key of the last insert, erase or find on every
+    // level, where the next search starts if its key is greater
+    node *m_finger[MAX_LEVEL];
+    bool  m_finger_ok;
+
     xorshift m_xs;
 
     uint8_t random_level();
+    node   *new_node(const K &key, const V &val, uint8_t level);
+    void    delete_node(node *x);
+    void    clear();
+    void    search(const K &key);
+    node   *search_from(node *x, const K &key, node **update, int &top);
+    node   *lower_node(const K &key) const;
+    node   *upper_node(const K &key) const;
+
+    iterator make_iter(node *n) { return iterator(n, &m_tail); }
+    const_iterator make_iter(node *n) const
+    {
+        return const_iterator(n, &m_tail);
+    }
 };
 
 template <typename K, typename V, int MAX_LEVEL>
-inline sl<K, V, MAX_LEVEL>::sl() : m_size(0), m_level(1)
+inline sl<K, V, MAX_LEVEL>::sl()
+    : m_pool(node::size(1), sizeof(node *), MAX_LEVEL, alignof(node)),
+      m_tail(nullptr), m_size(0), m_level(1), m_finger_ok(true)
 {
-    m_header = new sl_node<K, V, MAX_LEVEL>;
-
-    m_header->m_level = MAX_LEVEL;
-    m_header->m_forward = new sl_node<K, V, MAX_LEVEL>*[MAX_LEVEL];
+    m_header = new_node(K(), V(), MAX_LEVEL);
+    m_header->m_backward = nullptr;
 
     for (int i = 0; i < MAX_LEVEL; i++) {
         m_header->m_forward[i] = nullptr;
+        m_finger[i]            = m_header;
     }
 }
 
 template <typename K, typename V, int MAX_LEVEL>
 inline sl<K, V, MAX_LEVEL>::~sl()
 {
-    auto p = m_header;
-    while (p != nullptr) {
-        auto p1 = p->m_forward[0];
-        delete p;
-        p = p1;
+    clear();
+}
+
+// the pool releases the memory in one go, only the keys and values may
+// need their destructors
+template <typename K, typename V, int MAX_LEVEL>
+inline void sl<K, V, MAX_LEVEL>::clear()
+{
+    if (! std::is_trivially_destructible<K>::value ||
+        ! std::is_trivially_destructible<V>::value) {
+        auto p = m_header;
+        while (p != nullptr) {
+            auto p1 = p->m_forward[0];
+            p->~node();
+            p = p1;
+        }
     }
+
+    m_pool.clear();
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::node *
+sl<K, V, MAX_LEVEL>::new_node(const K &key, const V &val, uint8_t level)
+{
+    void *p = m_pool.alloc(level - 1);
+
+    return new (p) node(key, val, level);
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline void sl<K, V, MAX_LEVEL>::delete_node(node *x)
+{
+    int level = x->m_level;
+
+    x->~node();
+    m_pool.free(x, level - 1);
 }
 
 template <typename K, typename V, int MAX_LEVEL>
@@ -91,13 +275,7 @@ inline uint8_t sl<K, V, MAX_LEVEL>::random_level()
     uint64_t max_level;
     uint64_t lvl = 1;
 
-    asm (
-        "lzcntq %0, %1;"
-        : "=r" (max_level)
-        : "r" (m_size)
-        );
-
-    max_level = 64 - max_level + 1;
+    max_level = 64 - cpu_clz64(m_size) + 1;
     max_level = max_level > MAX_LEVEL ? MAX_LEVEL : max_level;
 
     while (lvl < max_level && m_xs.xor128() < (UINT32_MAX / 2))
@@ -109,60 +287,55 @@ inline uint8_t sl<K, V, MAX_LEVEL>::random_level()
 template <typename K, typename V, int MAX_LEVEL>
 inline void sl<K, V, MAX_LEVEL>::insert(const K &key, const V &val)
 {
-    sl_node<K, V, MAX_LEVEL> *update[MAX_LEVEL];
-    sl_node<K, V, MAX_LEVEL> *x = m_header;
-    auto new_node = new sl_node<K, V, MAX_LEVEL>();
+    node **update = m_finger;
 
-    new_node->m_level = random_level();
-    new_node->m_forward = new sl_node<K, V, MAX_LEVEL>*[new_node->m_level];
+    search(key);
 
-    for (int i = m_level - 1; i >= 0; i--) {
-        while (x->m_forward[i] != nullptr && x->m_forward[i]->m_key < key)
-            x = x->m_forward[i];
+    node *x = update[0]->m_forward[0];
 
-        update[i] = x;
+    if (x != nullptr && x->m_kv.first == key) {
+        x->m_kv.second = val;
+        return;
     }
 
-    if (x->m_key == key) {
-        x->m_val = val;
-        delete new_node;
-    } else {
-        if (new_node->m_level > m_level) {
-            for (int i = m_level; i < new_node->m_level; i++) {
-                update[i] = m_header;
-            }
+    uint8_t level = random_level();
 
-            m_level = new_node->m_level;
+    if (level > m_level) {
+        for (int i = m_level; i < level; i++) {
+            update[i] = m_header;
         }
 
-        new_node->m_key = key;
-        new_node->m_val = val;
+        m_level = level;
+    }
 
-        for (int i = 0; i < new_node->m_level; i++) {
-            new_node->m_forward[i]  = update[i]->m_forward[i];
-            update[i]->m_forward[i] = new_node;
-        }
+    x = new_node(key, val, level);
 
-        m_size++;
+    for (int i = 0; i < level; i++) {
+        x->m_forward[i]         = update[i]->m_forward[i];
+        update[i]->m_forward[i] = x;
     }
+
+    x->m_backward = update[0] != m_header ? update[0] : nullptr;
+
+    if (x->m_forward[0] != nullptr) {
+        x->m_forward[0]->m_backward = x;
+    } else {
+        m_tail = x;
+    }
+
+    m_size++;
 }
 
 template <typename K, typename V, int MAX_LEVEL>
 inline void sl<K, V, MAX_LEVEL>::erase(const K &key)
 {
-    sl_node<K, V, MAX_LEVEL> *update[MAX_LEVEL];
-    sl_node<K, V, MAX_LEVEL> *x = m_header, *p = nullptr;
-
-    for (int i = m_level - 1; i >= 0; i--) {
-        while (x->m_forward[i] != nullptr && x->m_forward[i]->m_key < key)
-            x = x->m_forward[i];
+    node **update = m_finger;
 
-        update[i] = x;
-    }
+    search(key);
 
-    x = x->m_forward[0];
+    node *x = update[0]->m_forward[0];
 
-    if (x != nullptr && x->m_key == key) {
+    if (x != nullptr && x->m_kv.first == key) {
         for (int i = 0; i < m_level; i++) {
             if (update[i]->m_forward[i] != x)
                 break;
@@ -170,36 +343,351 @@ inline void sl<K, V, MAX_LEVEL>::erase(const K &key)
             update[i]->m_forward[i] = x->m_forward[i];
         }
 
-        p = x;
+        if (x->m_forward[0] != nullptr) {
+            x->m_forward[0]->m_backward = x->m_backward;
+        } else {
+            m_tail = x->m_backward;
+        }
+
+        delete_node(x);
+        m_size--;
 
         int i = m_level - 1;
-        while(i >= 0 && m_header->m_forward[i] == nullptr) {
+        while(i > 0 && m_header->m_forward[i] == nullptr) {
             i--;
         }
 
         m_level = i + 1;
     }
+}
+
+// fill m_finger[0, m_level) with the predecessors of key
+//
+// Finger search after Pugh: if key is past the finger, climb from level 0
+// while the finger's successor one level up is still less than key, then
+// search down from there. The fingers above stay valid, so a key d entries
+// after the last one costs O(log d), and ascending keys O(1) amortized.
+template <typename K, typename V, int MAX_LEVEL>
+inline void sl<K, V, MAX_LEVEL>::search(const K &key)
+{
+    int   lvl = m_level - 1;
+    node *x   = m_header;
+
+    if (m_finger_ok &&
+        (m_finger[0] == m_header || m_finger[0]->m_kv.first < key)) {
+        lvl = 0;
+
+        while (lvl + 1 < m_level &&
+               m_finger[lvl + 1]->m_forward[lvl + 1] != nullptr &&
+               m_finger[lvl + 1]->m_forward[lvl + 1]->m_kv.first < key)
+            lvl++;
+
+        x = m_finger[lvl];
+    }
+
+    for (int i = lvl; i >= 0; i--) {
+        while (x->m_forward[i] != nullptr &&
+               x->m_forward[i]->m_kv.first < key)
+            x = x->m_forward[i];
+
+        m_finger[i] = x;
+    }
 
-    delete p;
+    m_finger_ok = true;
 }
 
+// predecessors of key on levels [0, top] searching forward from x, whose
+// key is less than key. moves along the top level of each node, which
+// leads to ever taller nodes, until that overshoots and then goes down.
+// returns the predecessor on level 0
 template <typename K, typename V, int MAX_LEVEL>
-inline const V* sl<K, V, MAX_LEVEL>::find(const K &key)
+inline typename sl<K, V, MAX_LEVEL>::node *
+sl<K, V, MAX_LEVEL>::search_from(node *x, const K &key, node **update,
+                                 int &top)
+{
+    for (;;) {
+        node *next = x->m_forward[x->m_level - 1];
+
+        if (next == nullptr || ! (next->m_kv.first < key))
+            break;
+
+        x = next;
+    }
+
+    top = x->m_level - 1;
+
+    for (int i = top; i >= 0; i--) {
+        while (x->m_forward[i] != nullptr &&
+               x->m_forward[i]->m_kv.first < key)
+            x = x->m_forward[i];
+
+        update[i] = x;
+    }
+
+    return x;
+}
+
+// first node with a key not less than key, or nullptr
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::node *
+sl<K, V, MAX_LEVEL>::lower_node(const K &key) const
+{
+    auto x = m_header;
+
+    for (int i = m_level - 1; i >= 0; i--) {
+        while (x->m_forward[i] != nullptr &&
+               x->m_forward[i]->m_kv.first < key)
+            x = x->m_forward[i];
+    }
+
+    return x->m_forward[0];
+}
+
+// first node with a key greater than key, or nullptr
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::node *
+sl<K, V, MAX_LEVEL>::upper_node(const K &key) const
 {
     auto x = m_header;
 
     for (int i = m_level - 1; i >= 0; i--) {
-        while (x->m_forward[i] != nullptr && x->m_forward[i]->m_key < key)
+        while (x->m_forward[i] != nullptr &&
+               ! (key < x->m_forward[i]->m_kv.first))
             x = x->m_forward[i];
     }
 
-    x = x->m_forward[0];
+    return x->m_forward[0];
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline const V* sl<K, V, MAX_LEVEL>::find(const K &key)
+{
+    search(key);
+
+    auto x = m_finger[0]->m_forward[0];
+
+    if (x != nullptr && x->m_kv.first == key) {
+        return &x->m_kv.second;
+    }
+
+    return nullptr;
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::iterator
+sl<K, V, MAX_LEVEL>::insert(const_iterator hint, const K &key, const V &val)
+{
+    node *h = hint.m_node;
+
+    if (h == nullptr || key < h->m_kv.first) {
+        insert(key, val);
+        return make_iter(m_finger[0]->m_forward[0]);
+    }
+
+    if (h->m_kv.first == key) {
+        h->m_kv.second = val;
+        return make_iter(h);
+    }
+
+    node   *update[MAX_LEVEL];
+    int     top;
+    node   *x     = search_from(h, key, update, top)->m_forward[0];
+    uint8_t level = random_level();
+
+    if (x != nullptr && x->m_kv.first == key) {
+        x->m_kv.second = val;
+        return make_iter(x);
+    }
+
+    // the predecessors above the hint's reach are unknown, search for them
+    if (level > top + 1) {
+        insert(key, val);
+        return make_iter(m_finger[0]->m_forward[0]);
+    }
+
+    x = new_node(key, val, level);
+
+    for (int i = 0; i < level; i++) {
+        x->m_forward[i]         = update[i]->m_forward[i];
+        update[i]->m_forward[i] = x;
+
+        // the finger may now skip a node which is less than its key
+        if (update[i] == m_finger[i]) {
+            m_finger_ok = false;
+        }
+    }
+
+    x->m_backward = update[0];
+
+    if (x->m_forward[0] != nullptr) {
+        x->m_forward[0]->m_backward = x;
+    } else {
+        m_tail = x;
+    }
+
+    m_size++;
+
+    return make_iter(x);
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline const V* sl<K, V, MAX_LEVEL>::find(const_iterator hint, const K &key)
+{
+    node *h = hint.m_node;
+
+    if (h == nullptr || key < h->m_kv.first) {
+        return find(key);
+    }
+
+    node *update[MAX_LEVEL];
+    int   top;
+    node *x = h->m_kv.first == key ? h :
+              search_from(h, key, update, top)->m_forward[0];
 
-    if (x != nullptr && x->m_key == key) {
-        return &x->m_val;
+    if (x != nullptr && x->m_kv.first == key) {
+        return &x->m_kv.second;
     }
 
     return nullptr;
 }
 
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::iterator
+sl<K, V, MAX_LEVEL>::lower_bound(const K &key)
+{
+    return make_iter(lower_node(key));
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::iterator
+sl<K, V, MAX_LEVEL>::upper_bound(const K &key)
+{
+    return make_iter(upper_node(key));
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::const_iterator
+sl<K, V, MAX_LEVEL>::lower_bound(const K &key) const
+{
+    return make_iter(lower_node(key));
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+inline typename sl<K, V, MAX_LEVEL>::const_iterator
+sl<K, V, MAX_LEVEL>::upper_bound(const K &key) const
+{
+    return make_iter(upper_node(key));
+}
+
+// walking level 0 is a chain of dependent loads. the forward pointers of
+// the upper levels point 2, 4, 8, ... nodes ahead, prefetching them lets
+// those misses overlap with the walk.
+template <typename K, typename V, int MAX_LEVEL>
+template <typename F>
+inline size_t sl<K, V, MAX_LEVEL>::range(const K &lo, const K &hi, F f)
+{
+    size_t n = 0;
+
+    for (auto x = lower_node(lo); x != nullptr && x->m_kv.first < hi;
+         x = x->m_forward[0]) {
+        int top = x->m_level < SL_PREFETCH_LEVELS ? x->m_level :
+                                                    SL_PREFETCH_LEVELS;
+
+        for (int i = 1; i < top; i++) {
+            __builtin_prefetch(x->m_forward[i]);
+        }
+
+        f(x->m_kv.first, x->m_kv.second);
+        n++;
+    }
+
+    return n;
+}
+
+template <typename K, typename V, int MAX_LEVEL>
+template <typename It>
+inline void sl<K, V, MAX_LEVEL>::bulk_load(It first, It last, bool random)
+{
+    typedef typename std::iterator_traits<It>::iterator_category category;
+
+    static_assert(std::is_base_of<std::forward_iterator_tag, category>::value,
+                  "bulk_load() walks its input twice");
+
+    uint64_t n = std::distance(first, last);
+    uint64_t max_level;
+    xorshift xs = m_xs;
+
+    max_level = 64 - cpu_clz64(n) + 1;
+    max_level = max_level > MAX_LEVEL ? MAX_LEVEL : max_level;
+
+    auto level = [&](uint64_t i) -> uint8_t {
+        uint64_t lvl = 1;
+
+        if (random) {
+            while (lvl < max_level && xs.xor128() < (UINT32_MAX / 2))
+                lvl++;
+        } else {
+            lvl += __builtin_ctzll(i + 1);
+        }
+
+        return lvl < max_level ? lvl : max_level;
+    };
+
+    // size the allocation with the same level sequence as the build below
+    size_t len = 0;
+
+    for (uint64_t i = 0; i < n; i++) {
+        len += m_pool.get_size(level(i) - 1);
+    }
+
+    xs = m_xs;
+
+    clear();
+
+    m_header = new_node(K(), V(), MAX_LEVEL);
+    m_header->m_backward = nullptr;
+
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        m_header->m_forward[i] = nullptr;
+        m_finger[i]            = m_header;
+    }
+
+    m_tail      = nullptr;
+    m_size      = 0;
+    m_level     = 1;
+    m_finger_ok = true;
+
+    if (n == 0)
+        return;
+
+    char *p = static_cast<char *>(m_pool.alloc_bulk(len));
+
+    // the list stays well-formed after every node, m_finger holds the last
+    // node of each level, which is also where the next insert starts from
+    for (; first != last; ++first) {
+        if (m_tail != nullptr && ! (m_tail->m_kv.first < first->first)) {
+            m_tail->m_kv.second = first->second;
+            continue;
+        }
+
+        uint8_t lvl = level(m_size);
+        node   *x   = new (p) node(first->first, first->second, lvl);
+
+        p += m_pool.get_size(lvl - 1);
+
+        for (int i = 0; i < lvl; i++) {
+            x->m_forward[i]           = nullptr;
+            m_finger[i]->m_forward[i] = x;
+            m_finger[i]               = x;
+        }
+
+        x->m_backward = m_tail;
+        m_tail        = x;
+        m_level       = lvl > m_level ? lvl : m_level;
+        m_size++;
+    }
+
+    m_xs = xs;
+}
+
 #endif // SL_HPP
@@ -0,0 +1,136 @@
+#ifndef SL_POOL_HPP
+#define SL_POOL_HPP
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#define SL_POOL_BLOCK (64 * 1024) // bytes carved per block
+
+// size-class slab allocator of one list
+//
+// Class c holds chunks of base + c * step bytes, i.e. the node of level
+// c + 1 with its inline forward array. Chunks are carved from blocks of
+// SL_POOL_BLOCK bytes and freed chunks go to a free list per class, so a
+// steady insert/erase load does not touch malloc. Nothing is returned to
+// the system before the pool is destroyed or clear()ed, which releases all
+// blocks at once. Not thread safe.
+class sl_pool {
+public:
+    sl_pool(size_t base, size_t step, int classes, size_t align);
+    ~sl_pool() { clear(); }
+
+    sl_pool(const sl_pool &) = delete;
+    sl_pool &operator=(const sl_pool &) = delete;
+
+    void *alloc(int cls);
+    void  free(void *p, int cls);
+    // one contiguous area of len bytes to carve chunks from by hand. they
+    // may be free()d to their class like any other
+    void *alloc_bulk(size_t len);
+    // release every block, all chunks become invalid
+    void  clear();
+
+    size_t get_size(int cls) const { return m_base + cls * m_step; }
+
+private:
+    struct chunk {
+        chunk *m_next;
+    };
+
+    size_t m_base;
+    size_t m_step;
+    size_t m_align;
+
+    std::vector<chunk *> m_free; // per class
+    std::vector<void *>  m_blocks;
+    char  *m_cur;
+    size_t m_left;
+
+    void *new_block(size_t len);
+};
+
+inline sl_pool::sl_pool(size_t base, size_t step, int classes, size_t align)
+    : m_base((base + align - 1) & ~(align - 1)),
+      m_step((step + align - 1) & ~(align - 1)),
+      m_align(align),
+      m_free(classes, nullptr),
+      m_cur(nullptr),
+      m_left(0)
+{
+    // a freed chunk must hold the free list link
+    if (m_base < sizeof(chunk)) {
+        m_base = sizeof(chunk);
+    }
+}
+
+inline void *sl_pool::new_block(size_t len)
+{
+    void *p;
+
+    if (posix_memalign(&p, m_align < sizeof(void *) ? sizeof(void *) : m_align,
+                       len) != 0) {
+        throw std::bad_alloc();
+    }
+
+    m_blocks.push_back(p);
+
+    return p;
+}
+
+inline void *sl_pool::alloc(int cls)
+{
+    chunk *c = m_free[cls];
+
+    if (c != nullptr) {
+        m_free[cls] = c->m_next;
+        return c;
+    }
+
+    size_t len = get_size(cls);
+
+    if (len > m_left) {
+        size_t block = len > SL_POOL_BLOCK ? len : SL_POOL_BLOCK;
+
+        m_cur  = static_cast<char *>(new_block(block));
+        m_left = block;
+    }
+
+    void *p = m_cur;
+
+    m_cur  += len;
+    m_left -= len;
+
+    return p;
+}
+
+inline void sl_pool::free(void *p, int cls)
+{
+    chunk *c = static_cast<chunk *>(p);
+
+    c->m_next   = m_free[cls];
+    m_free[cls] = c;
+}
+
+inline void *sl_pool::alloc_bulk(size_t len)
+{
+    return new_block(len > 0 ? len : 1);
+}
+
+inline void sl_pool::clear()
+{
+    for (void *p : m_blocks) {
+        ::free(p);
+    }
+
+    m_blocks.clear();
+    std::fill(m_free.begin(), m_free.end(), nullptr);
+
+    m_cur  = nullptr;
+    m_left = 0;
+}
+
+#endif // SL_POOL_HPP